@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "arena.h"
+#include "globals.h"
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Arenas are reserved from the central directory sizes, and stored entries of mapped zip files
+// never use their slice: anonymous mappings only take memory for the pages actually written.
+t_arena *arena_new(size_t size) {
+    t_arena *arena = (t_arena *)calloc(1, sizeof(t_arena));
+
+    if (!arena) return NULL;
+    size = size ? ARENA_SLICE(size) : ARENA_ALIGN;
+#if !defined(_WIN32) && !defined(_WIN64)
+    void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (base != MAP_FAILED) {
+        arena->base = (unsigned char *)base;
+        arena->mapped = 1;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        if (size >= HUGE_PAGE_SIZE) madvise(base, size, MADV_HUGEPAGE);
+#endif
+    }
+#endif
+    if (!arena->base) {
+        // malloc is 16 bytes aligned at best: slices are aligned from the start of the block
+        arena->base = (unsigned char *)malloc(size + ARENA_ALIGN);
+        if (!arena->base) {
+            free(arena);
+            return NULL;
+        }
+    }
+    arena->size = size;
+    arena->refs = 1;
+    if (trace > 0) printf("arena: %lu bytes%s\n", (unsigned long)size, arena->mapped ? " mapped" : "");
+    return arena;
+}
+
+unsigned char *arena_alloc(t_arena *arena, size_t size) {
+    size_t slice = ARENA_SLICE(size ? size : 1);
+    size_t offset = __atomic_fetch_add(&arena->used, slice, __ATOMIC_RELAXED);
+    unsigned char *base;
+
+    if (offset + slice > arena->size) return NULL;  // used stays past size, later calls fail too
+    base = arena->mapped ? arena->base : (unsigned char *)ARENA_SLICE((size_t)arena->base);
+    __atomic_add_fetch(&arena->refs, 1, __ATOMIC_RELAXED);
+    return base + offset;
+}
+
+int arena_frees_pages(const t_arena *arena) {
+#if defined(__linux__)
+    return arena->mapped;
+#else
+    return 0;
+#endif
+}
+
+void arena_free(t_arena *arena, unsigned char *data, size_t size) {
+#if defined(__linux__)
+    if (arena_frees_pages(arena)) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t start = ((size_t)data + page - 1) & ~(page - 1);
+        size_t end = ((size_t)data + size) & ~(page - 1);
+
+        if (start < end) madvise((void *)start, end - start, MADV_DONTNEED);
+    }
+#endif
+    arena_release(arena);
+}
+
+void arena_release(t_arena *arena) {
+    if (__atomic_sub_fetch(&arena->refs, 1, __ATOMIC_ACQ_REL)) return;
+    if (trace > 0) printf("arena: released %lu bytes\n", (unsigned long)arena->size);
+#if !defined(_WIN32) && !defined(_WIN64)
+    if (arena->mapped) {
+        munmap(arena->base, arena->size);
+        free(arena);
+        return;
+    }
+#endif
+    free(arena->base);
+    free(arena);
+}
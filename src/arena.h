@@ -0,0 +1,34 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+#define ARENA_ALIGN 64  // slices start on a cache line
+
+/*
+    One block of memory for the uncompressed entries of a zip file, cut in slices.
+    Every slice holds a reference to the arena, as does its creator: the arena is freed at once,
+    when the last reference is released.
+*/
+typedef struct s_arena {
+    unsigned char *base;
+    size_t size;
+    size_t used;
+    int refs;
+    int mapped;  // base was mmap()'d rather than malloc'd
+} t_arena;
+
+t_arena *arena_new(size_t size);
+// A slice of size bytes, NULL when the arena is full. Can be called from several threads.
+unsigned char *arena_alloc(t_arena *arena, size_t size);
+void arena_release(t_arena *arena);
+// Give a slice back: the pages it covers are returned to the system right away when the arena is
+// mapped, then its reference is released
+void arena_free(t_arena *arena, unsigned char *data, size_t size);
+// Whether arena_free() returns pages to the system. When it does not, a slice keeps the whole arena in memory.
+int arena_frees_pages(const t_arena *arena);
+
+// Size taken in an arena by a slice of size bytes
+#define ARENA_SLICE(size) (((size) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+#endif
@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "globals.h"
+
+#define CACHE_BUCKETS 1024
+
+typedef struct s_cache_entry {
+    uint32_t crc32;
+    size_t size;
+    unsigned char *data;
+    t_arena *arena;                    // arena data is a slice of, NULL if data was malloc'd
+    int users;                         // number of ROMs using the entry, which cannot be dropped until released
+    struct s_cache_entry *next;        // next entry in the bucket
+    struct s_cache_entry *lru_prev;    // more recently used entry
+    struct s_cache_entry *lru_next;    // less recently used entry
+} t_cache_entry;
+
+static t_cache_entry *buckets[CACHE_BUCKETS];
+static t_cache_entry *lru_first = NULL;  // most recently used
+static t_cache_entry *lru_last = NULL;   // least recently used
+static size_t cache_size = 0;
+
+static t_cache_entry **find_entry(uint32_t crc32, size_t size) {
+    t_cache_entry **entry = buckets + (crc32 % CACHE_BUCKETS);
+
+    while (*entry && ((*entry)->crc32 != crc32 || (*entry)->size != size)) {
+        entry = &(*entry)->next;
+    }
+    return entry;
+}
+
+static void free_data(unsigned char *data, size_t size, t_arena *arena) {
+    if (arena) arena_free(arena, data, size);
+    else free(data);
+}
+
+static void lru_unlink(t_cache_entry *entry) {
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else lru_first = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else lru_last = entry->lru_prev;
+}
+
+static void lru_push(t_cache_entry *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = lru_first;
+    if (lru_first) lru_first->lru_prev = entry;
+    else lru_last = entry;
+    lru_first = entry;
+}
+
+// Drop least recently used entries until the cache fits in its budget
+static void cache_trim() {
+    t_cache_entry *entry = lru_last;
+
+    while (entry && cache_size > cache_budget) {
+        t_cache_entry *prev = entry->lru_prev;
+
+        if (!entry->users) {
+            t_cache_entry **slot = find_entry(entry->crc32, entry->size);
+
+            if (trace > 0) printf("cache: dropping %08x (%lu bytes)\n", entry->crc32, entry->size);
+            *slot = entry->next;
+            lru_unlink(entry);
+            cache_size -= entry->size;
+            free_data(entry->data, entry->size, entry->arena);
+            free(entry);
+        }
+        entry = prev;
+    }
+}
+
+// Returns the data of an entry, or NULL if not in the cache. The entry stays in the cache until cache_release().
+unsigned char *cache_get(uint32_t crc32, size_t size) {
+    t_cache_entry *entry = *find_entry(crc32, size);
+
+    if (!entry) return NULL;
+    if (trace > 0) printf("cache: found %08x (%lu bytes)\n", crc32, size);
+    entry->users++;
+    lru_unlink(entry);
+    lru_push(entry);
+    return entry->data;
+}
+
+void cache_release(uint32_t crc32, size_t size) {
+    t_cache_entry *entry = *find_entry(crc32, size);
+
+    if (entry && entry->users) entry->users--;
+    cache_trim();
+}
+
+// Hand over uncompressed data to the cache, which frees it (or releases its arena) when it is not needed anymore
+void cache_put(uint32_t crc32, size_t size, unsigned char *data, t_arena *arena) {
+    t_cache_entry **slot = find_entry(crc32, size);
+    t_cache_entry *entry;
+
+    if (*slot || !size || size > cache_budget) {  // already there or too big to fit
+        free_data(data, size, arena);
+        return;
+    }
+    // The budget only counts entry sizes: a slice must not keep the rest of its arena in memory
+    if (arena && !arena_frees_pages(arena)) {
+        unsigned char *copy = (unsigned char *)malloc(size);
+
+        if (copy) memcpy(copy, data, size);
+        free_data(data, size, arena);
+        if (!copy) return;
+        data = copy;
+        arena = NULL;
+    }
+
+    entry = (t_cache_entry *)calloc(1, sizeof(t_cache_entry));
+    entry->crc32 = crc32;
+    entry->size = size;
+    entry->data = data;
+    entry->arena = arena;
+    *slot = entry;
+    lru_push(entry);
+    cache_size += size;
+    cache_trim();
+}
@@ -0,0 +1,16 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+// Uncompressed zip entries kept from one ROM to the next, identified by crc and size.
+// The least recently used entries are dropped when the total size exceeds cache_budget.
+
+unsigned char *cache_get(uint32_t crc32, size_t size);
+void cache_release(uint32_t crc32, size_t size);
+void cache_put(uint32_t crc32, size_t size, unsigned char *data, t_arena *arena);
+
+#endif
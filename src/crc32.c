@@ -0,0 +1,181 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/*
+    CRC32 (reflected polynomial 0xEDB88320, as in zip files)
+
+    The portable path is slice-by-16: 16 tables of 256 entries, table[k][b] being the crc of byte b
+    followed by k zero bytes, so 16 input bytes are folded with 16 independent lookups.
+    The x86 path folds 64 bytes at a time in four 128 bits registers with carry-less multiplications,
+    then reduces them to 32 bits (Barrett reduction); the tail goes through slice-by-16.
+*/
+
+static uint32_t crc_table[16][256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void make_crc_table() {
+    uint32_t c;
+    int i, j, k;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++) {
+            c = c & 1 ? (c >> 1) ^ 0xedb88320 : c >> 1;
+        }
+        crc_table[0][i] = c;
+    }
+    for (i = 0; i < 256; i++) {
+        for (k = 1; k < 16; k++) {
+            c = crc_table[k - 1][i];
+            crc_table[k][i] = (c >> 8) ^ crc_table[0][c & 0xff];
+        }
+    }
+}
+
+// Little endian 32 bits word at p
+#define LE32(p) ((uint32_t)(p)[0] | (uint32_t)(p)[1] << 8 | (uint32_t)(p)[2] << 16 | (uint32_t)(p)[3] << 24)
+
+// Works on the inverted crc
+static uint32_t slice_by_16(uint32_t crc, const uint8_t *ptr, size_t length) {
+    uint32_t w0, w1, w2, w3;
+
+    while (length >= 16) {
+        w0 = LE32(ptr) ^ crc;
+        w1 = LE32(ptr + 4);
+        w2 = LE32(ptr + 8);
+        w3 = LE32(ptr + 12);
+        crc = crc_table[15][w0 & 0xff] ^ crc_table[14][(w0 >> 8) & 0xff] ^
+              crc_table[13][(w0 >> 16) & 0xff] ^ crc_table[12][w0 >> 24] ^
+              crc_table[11][w1 & 0xff] ^ crc_table[10][(w1 >> 8) & 0xff] ^
+              crc_table[9][(w1 >> 16) & 0xff] ^ crc_table[8][w1 >> 24] ^
+              crc_table[7][w2 & 0xff] ^ crc_table[6][(w2 >> 8) & 0xff] ^
+              crc_table[5][(w2 >> 16) & 0xff] ^ crc_table[4][w2 >> 24] ^
+              crc_table[3][w3 & 0xff] ^ crc_table[2][(w3 >> 8) & 0xff] ^
+              crc_table[1][(w3 >> 16) & 0xff] ^ crc_table[0][w3 >> 24];
+        ptr += 16;
+        length -= 16;
+    }
+    while (length--) {
+        crc = crc_table[0][(crc ^ *ptr++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef X86_KERNELS
+
+// Folds length bytes (at least 64, a multiple of 16) into the inverted crc
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t fold_pclmul(uint32_t crc, const uint8_t *ptr, size_t length) {
+    // x^(4*128+32), x^(4*128-32), x^(128+32), x^(128-32), x^64 mod P, then P and mu for Barrett
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) = {0x0154442bd4, 0x01c6e41596};
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) = {0x01751997d0, 0x00ccaa009e};
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) = {0x0163cd6124, 0x0000000000};
+    static const uint64_t poly[2] __attribute__((aligned(16))) = {0x01db710641, 0x01f7011641};
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+    __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)ptr), _mm_cvtsi32_si128(crc));
+    x2 = _mm_loadu_si128((const __m128i *)(ptr + 16));
+    x3 = _mm_loadu_si128((const __m128i *)(ptr + 32));
+    x4 = _mm_loadu_si128((const __m128i *)(ptr + 48));
+    ptr += 64;
+    length -= 64;
+
+    // Four independent folds per 64 bytes
+    x0 = _mm_load_si128((const __m128i *)k1k2);
+    while (length >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)ptr));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(ptr + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(ptr + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(ptr + 48)));
+        ptr += 64;
+        length -= 64;
+    }
+
+    // Fold the four registers into one, then the remaining 16 bytes blocks
+    x0 = _mm_load_si128((const __m128i *)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+    while (length >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)ptr)), x5);
+        ptr += 16;
+        length -= 16;
+    }
+
+    // 128 to 64 bits
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction to 32 bits
+    x0 = _mm_load_si128((const __m128i *)poly);
+    x2 = _mm_and_si128(x1, mask32);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, mask32);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return _mm_extract_epi32(x1, 1);
+}
+
+static int has_pclmul() {
+    static int supported = -1;
+
+    if (supported == -1) {
+        __builtin_cpu_init();
+        supported = __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+    }
+    return supported;
+}
+
+#endif
+
+uint32_t crc32_portable(uint32_t crc, const void *data, size_t length) {
+    pthread_once(&crc_table_once, make_crc_table);
+    return ~slice_by_16(~crc, (const uint8_t *)data, length);
+}
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t length) {
+    const uint8_t *ptr = (const uint8_t *)data;
+
+    pthread_once(&crc_table_once, make_crc_table);
+    crc = ~crc;
+#ifdef X86_KERNELS
+    if (length >= 64 && has_pclmul()) {
+        size_t n = length & ~(size_t)15;
+
+        crc = fold_pclmul(crc, ptr, n);
+        ptr += n;
+        length -= n;
+    }
+#endif
+    return ~slice_by_16(crc, ptr, length);
+}
@@ -0,0 +1,14 @@
+#ifndef _CRC32_H_
+#define _CRC32_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// zlib compatible crc32: start from 0, pass the result of the previous call to continue.
+// Uses carry-less multiplication folding (PCLMULQDQ) when the CPU has it, slice-by-16 otherwise.
+uint32_t crc32_update(uint32_t crc, const void *data, size_t length);
+
+// Same, always with the portable slice-by-16 code
+uint32_t crc32_portable(uint32_t crc, const void *data, size_t length);
+
+#endif
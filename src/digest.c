@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "crc32.h"
+#include "digest.h"
+
+/*
+    Single pass digests
+
+    digest_update() walks the data in slices small enough to stay in the L1 cache and runs every
+    selected digest on a slice before moving to the next one, so the ROM is read from memory once
+    whatever the number of digests.
+*/
+
+#define DIGEST_SLICE 8192
+
+#define ROL(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+
+static void sha1_body(t_sha1_ctx *ctx, const unsigned char *ptr, size_t n_blocks) {
+    uint32_t w[80];
+    uint32_t a, b, c, d, e, t;
+    int i;
+
+    while (n_blocks--) {
+        for (i = 0; i < 16; i++) {
+            w[i] = (uint32_t)ptr[i * 4] << 24 | (uint32_t)ptr[i * 4 + 1] << 16 | (uint32_t)ptr[i * 4 + 2] << 8 | ptr[i * 4 + 3];
+        }
+        for (; i < 80; i++) {
+            t = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i] = ROL(t, 1);
+        }
+        a = ctx->state[0];
+        b = ctx->state[1];
+        c = ctx->state[2];
+        d = ctx->state[3];
+        e = ctx->state[4];
+        for (i = 0; i < 80; i++) {
+            if (i < 20) {
+                t = (d ^ (b & (c ^ d))) + 0x5a827999;
+            } else if (i < 40) {
+                t = (b ^ c ^ d) + 0x6ed9eba1;
+            } else if (i < 60) {
+                t = ((b & c) | (d & (b | c))) + 0x8f1bbcdc;
+            } else {
+                t = (b ^ c ^ d) + 0xca62c1d6;
+            }
+            t += ROL(a, 5) + e + w[i];
+            e = d;
+            d = c;
+            c = ROL(b, 30);
+            b = a;
+            a = t;
+        }
+        ctx->state[0] += a;
+        ctx->state[1] += b;
+        ctx->state[2] += c;
+        ctx->state[3] += d;
+        ctx->state[4] += e;
+        ptr += 64;
+    }
+}
+
+static void sha1_init(t_sha1_ctx *ctx) {
+    ctx->state[0] = 0x67452301;
+    ctx->state[1] = 0xefcdab89;
+    ctx->state[2] = 0x98badcfe;
+    ctx->state[3] = 0x10325476;
+    ctx->state[4] = 0xc3d2e1f0;
+    ctx->length = 0;
+}
+
+static void sha1_update(t_sha1_ctx *ctx, const unsigned char *data, size_t length) {
+    size_t used = ctx->length & 63;
+    size_t available = 64 - used;
+
+    ctx->length += length;
+    if (used) {
+        if (length < available) {
+            memcpy(ctx->buffer + used, data, length);
+            return;
+        }
+        memcpy(ctx->buffer + used, data, available);
+        sha1_body(ctx, ctx->buffer, 1);
+        data += available;
+        length -= available;
+    }
+    sha1_body(ctx, data, length / 64);
+    memcpy(ctx->buffer, data + (length & ~(size_t)63), length & 63);
+}
+
+static void sha1_final(t_sha1_ctx *ctx, unsigned char sha1[20]) {
+    unsigned char padding[72] = {0x80};
+    uint64_t bits = ctx->length * 8;
+    size_t n = ((ctx->length & 63) < 56 ? 56 : 120) - (ctx->length & 63);
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        padding[n + i] = bits >> (56 - i * 8);
+    }
+    sha1_update(ctx, padding, n + 8);
+    for (i = 0; i < 20; i++) {
+        sha1[i] = ctx->state[i / 4] >> (24 - (i % 4) * 8);
+    }
+}
+
+void digest_init(t_digest *digest, int selected) {
+    digest->selected = selected;
+    if (selected & DIGEST_MD5) MD5_Init(&digest->md5_ctx);
+    if (selected & DIGEST_CRC32) digest->crc32 = 0;
+    if (selected & DIGEST_SHA1) sha1_init(&digest->sha1_ctx);
+}
+
+void digest_update(t_digest *digest, const void *data, size_t length) {
+    const unsigned char *ptr = (const unsigned char *)data;
+
+    while (length) {
+        size_t n = length < DIGEST_SLICE ? length : DIGEST_SLICE;
+
+        if (digest->selected & DIGEST_MD5) MD5_Update(&digest->md5_ctx, ptr, n);
+        if (digest->selected & DIGEST_CRC32) digest->crc32 = crc32_update(digest->crc32, ptr, n);
+        if (digest->selected & DIGEST_SHA1) sha1_update(&digest->sha1_ctx, ptr, n);
+        ptr += n;
+        length -= n;
+    }
+}
+
+void digest_final(t_digest *digest) {
+    if (digest->selected & DIGEST_MD5) MD5_Final(digest->md5, &digest->md5_ctx);
+    if (digest->selected & DIGEST_SHA1) sha1_final(&digest->sha1_ctx, digest->sha1);
+}
+
+int digest_parse(const char *names) {
+    static const char *digest_names[] = {"md5", "crc32", "sha1"};
+    int selected = 0;
+    size_t n;
+    int i;
+
+    while (*names) {
+        n = strcspn(names, ",");
+        for (i = 0; i < 3; i++) {
+            if (strlen(digest_names[i]) == n && !strncmp(names, digest_names[i], n)) break;
+        }
+        if (i == 3) return -1;
+        selected |= 1 << i;
+        names += n;
+        if (*names) names++;
+    }
+    return selected;
+}
+
+void digest_print(t_digest *digest, int selected, const char *filename) {
+    int i;
+
+    printf("%s", filename);
+    if (selected & DIGEST_MD5) {
+        printf("\tmd5:");
+        for (i = 0; i < 16; i++) printf("%02x", digest->md5[i]);
+    }
+    if (selected & DIGEST_CRC32) {
+        printf("\tcrc32:%08x", digest->crc32);
+    }
+    if (selected & DIGEST_SHA1) {
+        printf("\tsha1:");
+        for (i = 0; i < 20; i++) printf("%02x", digest->sha1[i]);
+    }
+    printf("\n");
+}
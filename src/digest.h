@@ -0,0 +1,38 @@
+#ifndef _DIGEST_H_
+#define _DIGEST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "md5.h"
+
+#define DIGEST_MD5 1
+#define DIGEST_CRC32 2
+#define DIGEST_SHA1 4
+
+typedef struct s_sha1_ctx {
+    uint32_t state[5];
+    uint64_t length;
+    unsigned char buffer[64];
+} t_sha1_ctx;
+
+// The digests of a ROM, all computed in the same pass over its bytes
+typedef struct s_digest {
+    int selected;  // DIGEST_* flags
+    MD5_CTX md5_ctx;
+    t_sha1_ctx sha1_ctx;
+    unsigned char md5[16];
+    uint32_t crc32;
+    unsigned char sha1[20];
+} t_digest;
+
+void digest_init(t_digest *digest, int selected);
+void digest_update(t_digest *digest, const void *data, size_t length);
+void digest_final(t_digest *digest);
+
+// Flags of a comma separated list of digest names (md5, crc32, sha1), -1 if a name is unknown
+int digest_parse(const char *names);
+// One line with the digests of filename in selected: "filename\tmd5:...\tcrc32:...\tsha1:..."
+void digest_print(t_digest *digest, int selected, const char *filename);
+
+#endif
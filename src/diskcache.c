@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <sys/mman.h>
+#endif
+
+#include "crc32.h"
+#include "diskcache.h"
+#include "globals.h"
+#include "utils.h"
+
+static char *get_cache_filename(uint32_t crc32, size_t size) {
+    char basename[32];
+
+    snprintf(basename, sizeof(basename), "%08x-%llu", crc32, (unsigned long long)size);
+    return get_filename(cache_dir, basename, "bin");
+}
+
+// Returns the data of an entry, or NULL if it is not in the cache.
+// *mapped tells whether the data is memory mapped (release with diskcache_release()) or malloc'd.
+unsigned char *diskcache_get(uint32_t crc32, size_t size, int *mapped) {
+    char *filename = get_cache_filename(crc32, size);
+    unsigned char *data = NULL;
+    struct stat st;
+    FILE *fp;
+
+    *mapped = 0;
+    fp = fopen(filename, "rb");
+    if (!fp) {
+        free(filename);
+        return NULL;
+    }
+    if (fstat(fileno(fp), &st) || st.st_size != size || !size) {
+        fclose(fp);
+        free(filename);
+        return NULL;
+    }
+
+#if !defined(_WIN32) && !defined(_WIN64)
+    data = (unsigned char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+    if (data != MAP_FAILED) {
+        *mapped = -1;
+    } else {
+        data = NULL;
+    }
+#endif
+    if (!data) {
+        data = (unsigned char *)malloc(size);
+        if (data && fread(data, 1, size, fp) != size) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(fp);
+
+    // A cache file can be truncated or damaged on disk: never hand out data that does not match its key
+    if (data && crc32_update(0, data, size) != crc32) {
+        printf("warning: corrupt file removed from cache: %s\n", filename);
+        if (*mapped) {
+            diskcache_release(data, size);
+        } else {
+            free(data);
+        }
+        data = NULL;
+        *mapped = 0;
+        remove(filename);
+    }
+    free(filename);
+
+    if (data && trace > 0) printf("disk cache: found %08x (%llu bytes)\n", crc32, (unsigned long long)size);
+    return data;
+}
+
+// Store an entry. It is written to a temporary file first and then renamed, so that
+// concurrent writers of the same entry never leave a partial file behind.
+void diskcache_put(uint32_t crc32, size_t size, unsigned char *data) {
+    static int counter = 0;
+    char *filename = get_cache_filename(crc32, size);
+    char *tmp_filename;
+    FILE *out;
+    int ok;
+
+    if (!size || file_exists(filename)) {
+        free(filename);
+        return;
+    }
+
+    // Unique among processes and among the threads of this process
+    tmp_filename = (char *)malloc(strlen(filename) + 32);
+    sprintf(tmp_filename, "%s.%ld.%d.tmp", filename, (long)getpid(), __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED));
+
+    if (!(out = fopen(tmp_filename, "wb"))) {
+        printf("warning: cannot write to cache directory: %s\n", cache_dir);
+        free(tmp_filename);
+        free(filename);
+        return;
+    }
+    ok = fwrite(data, 1, size, out) == size;
+    ok = !fclose(out) && ok;
+    if (!ok || rename(tmp_filename, filename)) {
+        remove(tmp_filename);  // on Windows, rename() fails when another writer was first: nothing lost
+    } else if (trace > 0) {
+        printf("disk cache: stored %08x (%llu bytes)\n", crc32, (unsigned long long)size);
+    }
+    free(tmp_filename);
+    free(filename);
+}
+
+void diskcache_release(unsigned char *data, size_t size) {
+#if !defined(_WIN32) && !defined(_WIN64)
+    munmap(data, size);
+#endif
+}
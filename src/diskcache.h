@@ -0,0 +1,13 @@
+#ifndef _DISKCACHE_H_
+#define _DISKCACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Uncompressed zip entries stored as files in cache_dir, named after their crc and size.
+
+unsigned char *diskcache_get(uint32_t crc32, size_t size, int *mapped);
+void diskcache_put(uint32_t crc32, size_t size, unsigned char *data);
+void diskcache_release(unsigned char *data, size_t size);
+
+#endif
@@ -1,8 +1,15 @@
 #ifndef _GLOBALS_H_
 #define _GLOBALS_H_
 
+#include <stddef.h>
+
 extern int trace;
 extern int verbose;
+extern int threads;
+extern size_t cache_budget;
+extern char *cache_dir;
+extern int low_memory;
+extern int digests;
 
 extern char *rom_basename;
 
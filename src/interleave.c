@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "globals.h"
+#include "interleave.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/*
+    Layouts with a dedicated kernel. CPS1/CPS2 style graphics ROMs are many MB of these.
+*/
+enum {
+    LAYOUT_GENERIC,  // anything else, scalar loop
+    LAYOUT_COPY,     // 1 part, pattern in order ("0", "01", "0123", ...)
+    LAYOUT_SWAP16,   // 1 part, pattern "10"
+    LAYOUT_SWAP32,   // 1 part, pattern "3210"
+    LAYOUT_BYTES2,   // 2 parts of 8 bits
+    LAYOUT_BYTES4,   // 4 parts of 8 bits
+    LAYOUT_WORDS2,   // 2 parts of 16 bits, each "01" or "10": LAYOUT_WORDS2 + bit j set when part j is "10"
+    LAYOUT_WORDS2_SWAP0,
+    LAYOUT_WORDS2_SWAP1,
+    LAYOUT_WORDS2_SWAP01,
+    N_LAYOUTS
+};
+
+// Vector kernels work on whole blocks of values and return how many values they did, the scalar loop does the rest.
+// src[j] points to the first value of part j.
+typedef size_t (*t_kernel)(uint8_t *dest, uint8_t **src, size_t n_values);
+
+static int is_pattern(int *byte_offsets, int n_src_bytes, const char *pattern) {
+    if (n_src_bytes != (int)strlen(pattern)) return 0;
+    for (int i = 0; i < n_src_bytes; i++) {
+        if (byte_offsets[i] != pattern[i] - '0') return 0;
+    }
+    return 1;
+}
+
+static int get_layout(int n_parts, int **byte_offsets, int *n_src_bytes) {
+    int i, swap = 0;
+
+    if (n_parts == 1) {
+        for (i = 0; i < n_src_bytes[0] && byte_offsets[0][i] == i; i++);
+        if (i == n_src_bytes[0]) return LAYOUT_COPY;
+        if (is_pattern(byte_offsets[0], n_src_bytes[0], "10")) return LAYOUT_SWAP16;
+        if (is_pattern(byte_offsets[0], n_src_bytes[0], "3210")) return LAYOUT_SWAP32;
+        return LAYOUT_GENERIC;
+    }
+    if (n_parts == 2 || n_parts == 4) {
+        for (i = 0; i < n_parts && n_src_bytes[i] == 1; i++);
+        if (i == n_parts) return n_parts == 2 ? LAYOUT_BYTES2 : LAYOUT_BYTES4;
+    }
+    if (n_parts == 2) {
+        for (i = 0; i < 2; i++) {
+            if (is_pattern(byte_offsets[i], n_src_bytes[i], "10")) {
+                swap |= 1 << i;
+            } else if (!is_pattern(byte_offsets[i], n_src_bytes[i], "01")) {
+                return LAYOUT_GENERIC;
+            }
+        }
+        return LAYOUT_WORDS2 + swap;
+    }
+    return LAYOUT_GENERIC;
+}
+
+static void interleave_scalar(uint8_t *dest, uint8_t **data, int n_parts, int **byte_offsets, int *n_src_bytes, int n_bytes_value, size_t first, size_t last) {
+    dest += first * n_bytes_value;
+    for (size_t i = first; i < last; i++) {        // iterate over values
+        for (int j = 0; j < n_parts; j++) {        // for each value, iterate over parts
+            const uint8_t *src = data[j] + i * n_src_bytes[j];
+            for (int k = 0; k < n_src_bytes[j]; k++) {  // for each part, iterate over the pattern
+                *dest++ = src[byte_offsets[j][k]];
+            }
+        }
+    }
+}
+
+#ifdef X86_KERNELS
+
+/*
+    SSE2 kernels, 16 bytes of each part per block
+*/
+
+__attribute__((target("sse2"))) static inline __m128i sse2_swap16(__m128i x) {
+    return _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+}
+
+__attribute__((target("sse2"))) static size_t sse2_swap16_kernel(uint8_t *dest, uint8_t **src, size_t n_values) {
+    size_t i;
+
+    for (i = 0; i + 8 <= n_values; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(src[0] + i * 2));
+        _mm_storeu_si128((__m128i *)(dest + i * 2), sse2_swap16(x));
+    }
+    return i;
+}
+
+__attribute__((target("sse2"))) static size_t sse2_swap32_kernel(uint8_t *dest, uint8_t **src, size_t n_values) {
+    size_t i;
+
+    for (i = 0; i + 4 <= n_values; i += 4) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(src[0] + i * 4));
+        x = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xB1), 0xB1);  // swap the 16 bits halves
+        _mm_storeu_si128((__m128i *)(dest + i * 4), sse2_swap16(x));
+    }
+    return i;
+}
+
+__attribute__((target("sse2"))) static size_t sse2_bytes2_kernel(uint8_t *dest, uint8_t **src, size_t n_values) {
+    size_t i;
+
+    for (i = 0; i + 16 <= n_values; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src[0] + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src[1] + i));
+        _mm_storeu_si128((__m128i *)(dest + i * 2), _mm_unpacklo_epi8(a, b));
+        _mm_storeu_si128((__m128i *)(dest + i * 2 + 16), _mm_unpackhi_epi8(a, b));
+    }
+    return i;
+}
+
+__attribute__((target("sse2"))) static size_t sse2_bytes4_kernel(uint8_t *dest, uint8_t **src, size_t n_values) {
+    size_t i;
+
+    for (i = 0; i + 16 <= n_values; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src[0] + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src[1] + i));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src[2] + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src[3] + i));
+        __m128i ab_lo = _mm_unpacklo_epi8(a, b), ab_hi = _mm_unpackhi_epi8(a, b);
+        __m128i cd_lo = _mm_unpacklo_epi8(c, d), cd_hi = _mm_unpackhi_epi8(c, d);
+        _mm_storeu_si128((__m128i *)(dest + i * 4), _mm_unpacklo_epi16(ab_lo, cd_lo));
+        _mm_storeu_si128((__m128i *)(dest + i * 4 + 16), _mm_unpackhi_epi16(ab_lo, cd_lo));
+        _mm_storeu_si128((__m128i *)(dest + i * 4 + 32), _mm_unpacklo_epi16(ab_hi, cd_hi));
+        _mm_storeu_si128((__m128i *)(dest + i * 4 + 48), _mm_unpackhi_epi16(ab_hi, cd_hi));
+    }
+    return i;
+}
+
+// swap is a constant in each of the kernels below, the tests go away once inlined
+__attribute__((target("sse2"), always_inline)) static inline size_t sse2_words2(uint8_t *dest, uint8_t **src, size_t n_values, int swap) {
+    size_t i;
+
+    for (i = 0; i + 8 <= n_values; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src[0] + i * 2));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src[1] + i * 2));
+        if (swap & 1) a = sse2_swap16(a);
+        if (swap & 2) b = sse2_swap16(b);
+        _mm_storeu_si128((__m128i *)(dest + i * 4), _mm_unpacklo_epi16(a, b));
+        _mm_storeu_si128((__m128i *)(dest + i * 4 + 16), _mm_unpackhi_epi16(a, b));
+    }
+    return i;
+}
+
+#define SSE2_WORDS2_KERNEL(name, swap) \
+    __attribute__((target("sse2"))) static size_t name(uint8_t *dest, uint8_t **src, size_t n_values) { \
+        return sse2_words2(dest, src, n_values, swap); \
+    }
+
+SSE2_WORDS2_KERNEL(sse2_words2_kernel, 0)
+SSE2_WORDS2_KERNEL(sse2_words2_swap0_kernel, 1)
+SSE2_WORDS2_KERNEL(sse2_words2_swap1_kernel, 2)
+SSE2_WORDS2_KERNEL(sse2_words2_swap01_kernel, 3)
+
+static t_kernel sse2_kernels[N_LAYOUTS] = {
+    [LAYOUT_SWAP16] = sse2_swap16_kernel,
+    [LAYOUT_SWAP32] = sse2_swap32_kernel,
+    [LAYOUT_BYTES2] = sse2_bytes2_kernel,
+    [LAYOUT_BYTES4] = sse2_bytes4_kernel,
+    [LAYOUT_WORDS2] = sse2_words2_kernel,
+    [LAYOUT_WORDS2_SWAP0] = sse2_words2_swap0_kernel,
+    [LAYOUT_WORDS2_SWAP1] = sse2_words2_swap1_kernel,
+    [LAYOUT_WORDS2_SWAP01] = sse2_words2_swap01_kernel,
+};
+
+/*
+    AVX2 kernels, 32 bytes of each part per block.
+    AVX2 unpacks work within 128 bits lanes: inputs get their 64 bits quarters reordered
+    as 0, 2, 1, 3 first, so that the unpacked outputs come out in order.
+*/
+
+#define AVX2_LANES(x) _mm256_permute4x64_epi64((x), 0xD8)
+
+__attribute__((target("avx2"))) static size_t avx2_swap16_kernel(uint8_t *dest, uint8_t **src, size_t n_values) {
+    const __m256i mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t i;
+
+    for (i = 0; i + 16 <= n_values; i += 16) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(src[0] + i * 2));
+        _mm256_storeu_si256((__m256i *)(dest + i * 2), _mm256_shuffle_epi8(x, mask));
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) static size_t avx2_swap32_kernel(uint8_t *dest, uint8_t **src, size_t n_values) {
+    const __m256i mask = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    size_t i;
+
+    for (i = 0; i + 8 <= n_values; i += 8) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(src[0] + i * 4));
+        _mm256_storeu_si256((__m256i *)(dest + i * 4), _mm256_shuffle_epi8(x, mask));
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) static size_t avx2_bytes2_kernel(uint8_t *dest, uint8_t **src, size_t n_values) {
+    size_t i;
+
+    for (i = 0; i + 32 <= n_values; i += 32) {
+        __m256i a = AVX2_LANES(_mm256_loadu_si256((const __m256i *)(src[0] + i)));
+        __m256i b = AVX2_LANES(_mm256_loadu_si256((const __m256i *)(src[1] + i)));
+        _mm256_storeu_si256((__m256i *)(dest + i * 2), _mm256_unpacklo_epi8(a, b));
+        _mm256_storeu_si256((__m256i *)(dest + i * 2 + 32), _mm256_unpackhi_epi8(a, b));
+    }
+    return i;
+}
+
+__attribute__((target("avx2"))) static size_t avx2_bytes4_kernel(uint8_t *dest, uint8_t **src, size_t n_values) {
+    size_t i;
+
+    for (i = 0; i + 32 <= n_values; i += 32) {
+        __m256i a = AVX2_LANES(_mm256_loadu_si256((const __m256i *)(src[0] + i)));
+        __m256i b = AVX2_LANES(_mm256_loadu_si256((const __m256i *)(src[1] + i)));
+        __m256i c = AVX2_LANES(_mm256_loadu_si256((const __m256i *)(src[2] + i)));
+        __m256i d = AVX2_LANES(_mm256_loadu_si256((const __m256i *)(src[3] + i)));
+        __m256i ab_lo = AVX2_LANES(_mm256_unpacklo_epi8(a, b)), ab_hi = AVX2_LANES(_mm256_unpackhi_epi8(a, b));
+        __m256i cd_lo = AVX2_LANES(_mm256_unpacklo_epi8(c, d)), cd_hi = AVX2_LANES(_mm256_unpackhi_epi8(c, d));
+        _mm256_storeu_si256((__m256i *)(dest + i * 4), _mm256_unpacklo_epi16(ab_lo, cd_lo));
+        _mm256_storeu_si256((__m256i *)(dest + i * 4 + 32), _mm256_unpackhi_epi16(ab_lo, cd_lo));
+        _mm256_storeu_si256((__m256i *)(dest + i * 4 + 64), _mm256_unpacklo_epi16(ab_hi, cd_hi));
+        _mm256_storeu_si256((__m256i *)(dest + i * 4 + 96), _mm256_unpackhi_epi16(ab_hi, cd_hi));
+    }
+    return i;
+}
+
+__attribute__((target("avx2"), always_inline)) static inline size_t avx2_words2(uint8_t *dest, uint8_t **src, size_t n_values, int swap) {
+    const __m256i mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    size_t i;
+
+    for (i = 0; i + 16 <= n_values; i += 16) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src[0] + i * 2));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src[1] + i * 2));
+        if (swap & 1) a = _mm256_shuffle_epi8(a, mask);
+        if (swap & 2) b = _mm256_shuffle_epi8(b, mask);
+        a = AVX2_LANES(a);
+        b = AVX2_LANES(b);
+        _mm256_storeu_si256((__m256i *)(dest + i * 4), _mm256_unpacklo_epi16(a, b));
+        _mm256_storeu_si256((__m256i *)(dest + i * 4 + 32), _mm256_unpackhi_epi16(a, b));
+    }
+    return i;
+}
+
+#define AVX2_WORDS2_KERNEL(name, swap) \
+    __attribute__((target("avx2"))) static size_t name(uint8_t *dest, uint8_t **src, size_t n_values) { \
+        return avx2_words2(dest, src, n_values, swap); \
+    }
+
+AVX2_WORDS2_KERNEL(avx2_words2_kernel, 0)
+AVX2_WORDS2_KERNEL(avx2_words2_swap0_kernel, 1)
+AVX2_WORDS2_KERNEL(avx2_words2_swap1_kernel, 2)
+AVX2_WORDS2_KERNEL(avx2_words2_swap01_kernel, 3)
+
+static t_kernel avx2_kernels[N_LAYOUTS] = {
+    [LAYOUT_SWAP16] = avx2_swap16_kernel,
+    [LAYOUT_SWAP32] = avx2_swap32_kernel,
+    [LAYOUT_BYTES2] = avx2_bytes2_kernel,
+    [LAYOUT_BYTES4] = avx2_bytes4_kernel,
+    [LAYOUT_WORDS2] = avx2_words2_kernel,
+    [LAYOUT_WORDS2_SWAP0] = avx2_words2_swap0_kernel,
+    [LAYOUT_WORDS2_SWAP1] = avx2_words2_swap1_kernel,
+    [LAYOUT_WORDS2_SWAP01] = avx2_words2_swap01_kernel,
+};
+
+#endif
+
+// Kernels for the CPU we run on, NULL if there are none. Looked up once.
+static t_kernel *get_kernels() {
+    static t_kernel *kernels = NULL;
+    static int initialized = 0;
+    const char *name = "scalar";
+
+    if (!__atomic_load_n(&initialized, __ATOMIC_ACQUIRE)) {
+#ifdef X86_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            kernels = avx2_kernels;
+            name = "avx2";
+        } else if (__builtin_cpu_supports("sse2")) {
+            kernels = sse2_kernels;
+            name = "sse2";
+        }
+#endif
+        if (trace > 0) printf("interleave kernels: %s\n", name);
+        __atomic_store_n(&initialized, 1, __ATOMIC_RELEASE);
+    }
+    return kernels;
+}
+
+void interleave(uint8_t *dest, uint8_t **data, int n_parts, int **byte_offsets, int *n_src_bytes, size_t first, size_t last) {
+    t_kernel *kernels = get_kernels();
+    int n_bytes_value = 0;
+    int layout;
+
+    if (first >= last) return;
+    for (int j = 0; j < n_parts; j++) n_bytes_value += n_src_bytes[j];
+    layout = get_layout(n_parts, byte_offsets, n_src_bytes);
+
+    if (layout == LAYOUT_COPY) {
+        memcpy(dest + first * n_bytes_value, data[0] + first * n_bytes_value, (last - first) * n_bytes_value);
+        return;
+    }
+    if (kernels && kernels[layout]) {
+        uint8_t *src[4];
+
+        for (int j = 0; j < n_parts; j++) src[j] = data[j] + first * n_src_bytes[j];
+        first += kernels[layout](dest + first * n_bytes_value, src, last - first);
+    }
+    interleave_scalar(dest, data, n_parts, byte_offsets, n_src_bytes, n_bytes_value, first, last);
+}
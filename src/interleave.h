@@ -0,0 +1,14 @@
+#ifndef _INTERLEAVE_H_
+#define _INTERLEAVE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Interleave the values [first, last) of a group into dest, the output of the whole group.
+    Part j contributes n_src_bytes[j] bytes to each value, read from data[j] in the order given by byte_offsets[j].
+    Common layouts go through vector kernels picked at runtime, everything else through a scalar loop.
+*/
+void interleave(uint8_t *dest, uint8_t **data, int n_parts, int **byte_offsets, int *n_src_bytes, size_t first, size_t last);
+
+#endif
@@ -1,24 +1,45 @@
 // JUnzip library by Joonas Pihlajamaa. See junzip.h for license and details.
 
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "../crc32.h"
 #include "junzip.h"
 
-unsigned char jzBuffer[JZ_BUFFER_SIZE];  // limits maximum zip descriptor size
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// 64 bit offsets for zip files past 2 GB read through stdio
+#if defined(_WIN32) || defined(_WIN64)
+#define jz_fseek _fseeki64
+#define jz_ftell _ftelli64
+#else
+#define jz_fseek fseeko
+#define jz_ftell ftello
+#endif
 
 // Read ZIP file end record. Will move within file.
+// Archives with more than 65535 entries or past 4 GB have a Zip64 end record as well,
+// found through the locator right before the 32 bit one: its values are used instead.
 int jzReadEndRecord(JZFile *zip, JZEndRecord *endRecord) {
-    long fileSize, readBytes, i;
-    JZEndRecord *er;
+    unsigned char jzBuffer[JZ_BUFFER_SIZE];  // limits maximum zip descriptor size
+    long readBytes, i;
+    size_t fileSize;
+    JZEndRecord32 *er;
+    JZEndLocator64 locator;
+    JZEndRecord64 er64;
 
     if (zip->seek(zip, 0, SEEK_END)) {
         fprintf(stderr, "Couldn't go to end of zip file!");
         return Z_ERRNO;
     }
 
-    if ((fileSize = zip->tell(zip)) <= sizeof(JZEndRecord)) {
+    if ((fileSize = zip->tell(zip)) <= sizeof(JZEndRecord32)) {
         fprintf(stderr, "Too small file to be a zip!");
         return Z_ERRNO;
     }
@@ -36,8 +57,8 @@ int jzReadEndRecord(JZFile *zip, JZEndRecord *endRecord) {
     }
 
     // Naively assume signature can only be found in one place...
-    for (i = readBytes - sizeof(JZEndRecord); i >= 0; i--) {
-        er = (JZEndRecord *)(jzBuffer + i);
+    for (i = readBytes - sizeof(JZEndRecord32); i >= 0; i--) {
+        er = (JZEndRecord32 *)(jzBuffer + i);
         if (er->signature == 0x06054B50)
             break;
     }
@@ -47,74 +68,172 @@ int jzReadEndRecord(JZFile *zip, JZEndRecord *endRecord) {
         return Z_ERRNO;
     }
 
-    memcpy(endRecord, er, sizeof(JZEndRecord));
+    if (er->diskNumber || er->centralDirectoryDiskNumber ||
+        er->numEntries != er->numEntriesThisDisk) {
+        fprintf(stderr, "Multifile zips not supported!");
+        return Z_ERRNO;
+    }
 
-    if (endRecord->diskNumber || endRecord->centralDirectoryDiskNumber ||
-        endRecord->numEntries != endRecord->numEntriesThisDisk) {
+    endRecord->numEntries = er->numEntries;
+    endRecord->centralDirectorySize = er->centralDirectorySize;
+    endRecord->centralDirectoryOffset = er->centralDirectoryOffset;
+
+    if (i >= (long)sizeof(JZEndLocator64)) {
+        memcpy(&locator, jzBuffer + i - sizeof(JZEndLocator64), sizeof(JZEndLocator64));
+    } else {
+        locator.signature = 0;
+    }
+
+    // No locator: a plain zip, whose 32 bit values are used as they are, even 0xFFFF entries
+    if (locator.signature != 0x07064B50)
+        return Z_OK;
+
+    if (locator.endRecordOffset > fileSize - sizeof(JZEndRecord64) ||
+        zip->seek(zip, locator.endRecordOffset, SEEK_SET)) {
+        fprintf(stderr, "Cannot seek in zip file!");
+        return Z_ERRNO;
+    }
+
+    if (zip->read(zip, &er64, sizeof(JZEndRecord64)) < sizeof(JZEndRecord64) ||
+        er64.signature != 0x06064B50) {
+        fprintf(stderr, "Zip64 end record signature not found in zip!");
+        return Z_ERRNO;
+    }
+
+    if (locator.numDisks > 1 || er64.diskNumber || er64.centralDirectoryDiskNumber ||
+        er64.numEntries != er64.numEntriesThisDisk) {
         fprintf(stderr, "Multifile zips not supported!");
         return Z_ERRNO;
     }
 
+    endRecord->numEntries = er64.numEntries;
+    endRecord->centralDirectorySize = er64.centralDirectorySize;
+    endRecord->centralDirectoryOffset = er64.centralDirectoryOffset;
+
     return Z_OK;
 }
 
+// Zip64 extended information extra field (id 0x0001): 64 bit values for the fields of header
+// left at 0xFFFFFFFF, in this order: uncompressed size, compressed size, offset. Only the
+// central directory has the offset. Fields without a value in extra keep their 32 bit one.
+static void jzReadZip64Extra(const unsigned char *extra, size_t length, JZFileHeader *header, int central) {
+    uint64_t values[3] = {header->uncompressedSize, header->compressedSize, header->offset};
+    int fields[3];  // index in values of the fields present in the extra field
+    uint16_t id, size;
+    int n = 0, j;
+
+    for (j = 0; j < (central ? 3 : 2); j++) {
+        if (values[j] == 0xFFFFFFFF) fields[n++] = j;
+    }
+
+    while (n && length >= 4) {
+        memcpy(&id, extra, sizeof(id));
+        memcpy(&size, extra + 2, sizeof(size));
+        extra += 4;
+        length -= 4;
+        if (size > length)
+            break;
+        if (id == 0x0001) {
+            for (j = 0; j < n && (j + 1) * 8 <= size; j++)
+                memcpy(values + fields[j], extra + j * 8, 8);
+            break;
+        }
+        extra += size;
+        length -= size;
+    }
+
+    header->uncompressedSize = values[0];
+    header->compressedSize = values[1];
+    header->offset = values[2];
+}
+
 // Read ZIP file global directory. Will move within file.
+// The whole directory is read at once (or used in place when the file is
+// memory mapped) and parsed in memory: no seek between entries.
 int jzReadCentralDirectory(JZFile *zip, JZEndRecord *endRecord,
                            JZRecordCallback callback, void *user_data) {
+    char filename[JZ_BUFFER_SIZE];
+    const unsigned char *directory, *ptr, *end;
+    unsigned char *buffer = NULL;
     JZGlobalFileHeader fileHeader;
     JZFileHeader header;
     int i;
 
-    if (zip->seek(zip, endRecord->centralDirectoryOffset, SEEK_SET)) {
+    if (endRecord->centralDirectorySize > SIZE_MAX ||
+        zip->seek(zip, endRecord->centralDirectoryOffset, SEEK_SET)) {
         fprintf(stderr, "Cannot seek in zip file!");
         return Z_ERRNO;
     }
 
-    for (i = 0; i < endRecord->numEntries; i++) {
-        if (zip->read(zip, &fileHeader, sizeof(JZGlobalFileHeader)) <
-            sizeof(JZGlobalFileHeader)) {
+    if (!zip->map || !(directory = (const unsigned char *)zip->map(zip, endRecord->centralDirectorySize))) {
+        if (!(buffer = (unsigned char *)malloc(endRecord->centralDirectorySize ? endRecord->centralDirectorySize : 1))) {
+            fprintf(stderr, "Couldn't allocate central directory!\n");
+            return Z_ERRNO;
+        }
+        if (zip->read(zip, buffer, endRecord->centralDirectorySize) < endRecord->centralDirectorySize) {
+            fprintf(stderr, "Couldn't read central directory!\n");
+            free(buffer);
+            return Z_ERRNO;
+        }
+        directory = buffer;
+    }
+    ptr = directory;
+    end = directory + endRecord->centralDirectorySize;
+
+    for (i = 0; (uint64_t)i < endRecord->numEntries; i++) {
+        if (end - ptr < sizeof(JZGlobalFileHeader)) {
             fprintf(stderr, "Couldn't read file header %d!\n", i);
+            free(buffer);
             return Z_ERRNO;
         }
+        memcpy(&fileHeader, ptr, sizeof(JZGlobalFileHeader));
+        ptr += sizeof(JZGlobalFileHeader);
 
         if (fileHeader.signature != 0x02014B50) {
             fprintf(stderr, "Invalid file header signature (%d): 0x%08X!\n", i, fileHeader.signature);
+            free(buffer);
             return Z_ERRNO;
         }
 
         if (fileHeader.fileNameLength + 1 >= JZ_BUFFER_SIZE) {
             fprintf(stderr, "Too long file name %d!\n", i);
+            free(buffer);
             return Z_ERRNO;
         }
 
-        if (zip->read(zip, jzBuffer, fileHeader.fileNameLength) <
-            fileHeader.fileNameLength) {
+        if (end - ptr < (long)fileHeader.fileNameLength + fileHeader.extraFieldLength + fileHeader.fileCommentLength) {
             fprintf(stderr, "Couldn't read filename %d!\n", i);
+            free(buffer);
             return Z_ERRNO;
         }
 
-        jzBuffer[fileHeader.fileNameLength] = '\0';  // NULL terminate
-
-        if (zip->seek(zip, fileHeader.extraFieldLength, SEEK_CUR) ||
-            zip->seek(zip, fileHeader.fileCommentLength, SEEK_CUR)) {
-            fprintf(stderr, "Couldn't skip extra field or file comment %d\n", i);
-            return Z_ERRNO;
-        }
+        memcpy(filename, ptr, fileHeader.fileNameLength);
+        filename[fileHeader.fileNameLength] = '\0';  // NULL terminate
 
         // Construct JZFileHeader from global file header
-        memcpy(&header, &fileHeader.compressionMethod, sizeof(header));
+        header.compressionMethod = fileHeader.compressionMethod;
+        header.lastModFileTime = fileHeader.lastModFileTime;
+        header.lastModFileDate = fileHeader.lastModFileDate;
+        header.crc32 = fileHeader.crc32;
+        header.compressedSize = fileHeader.compressedSize;
+        header.uncompressedSize = fileHeader.uncompressedSize;
         header.offset = fileHeader.relativeOffsetOflocalHeader;
+        jzReadZip64Extra(ptr + fileHeader.fileNameLength, fileHeader.extraFieldLength, &header, 1);
 
-        if (!callback(zip, i, &header, (char *)jzBuffer, user_data))
+        ptr += fileHeader.fileNameLength + fileHeader.extraFieldLength + fileHeader.fileCommentLength;
+
+        if (!callback(zip, i, &header, filename, user_data))
             break;  // end if callback returns zero
     }
 
+    free(buffer);
     return Z_OK;
 }
 
 // Read local ZIP file header. Silent on errors so optimistic reading possible.
-int jzReadLocalFileHeaderRaw(JZFile *zip, JZLocalFileHeader *header,
-                             char *filename, int len) {
+// The extra field is read to extra (JZ_BUFFER_SIZE bytes) if not NULL, skipped otherwise.
+static int jzReadLocalFileHeaderExtra(JZFile *zip, JZLocalFileHeader *header,
+                                      char *filename, int len, unsigned char *extra) {
     if (zip->read(zip, header, sizeof(JZLocalFileHeader)) <
         sizeof(JZLocalFileHeader))
         return Z_ERRNO;
@@ -137,7 +256,10 @@ int jzReadLocalFileHeaderRaw(JZFile *zip, JZLocalFileHeader *header,
     }
 
     if (header->extraFieldLength) {
-        if (zip->seek(zip, header->extraFieldLength, SEEK_CUR))
+        if (extra) {
+            if (zip->read(zip, extra, header->extraFieldLength) < header->extraFieldLength)
+                return Z_ERRNO;
+        } else if (zip->seek(zip, header->extraFieldLength, SEEK_CUR))
             return Z_ERRNO;
     }
 
@@ -152,33 +274,68 @@ int jzReadLocalFileHeaderRaw(JZFile *zip, JZLocalFileHeader *header,
     return Z_OK;
 }
 
+int jzReadLocalFileHeaderRaw(JZFile *zip, JZLocalFileHeader *header,
+                             char *filename, int len) {
+    return jzReadLocalFileHeaderExtra(zip, header, filename, len, NULL);
+}
+
 int jzReadLocalFileHeader(JZFile *zip, JZFileHeader *header,
                           char *filename, int len) {
+    unsigned char extra[JZ_BUFFER_SIZE];
     JZLocalFileHeader localHeader;
 
-    if (jzReadLocalFileHeaderRaw(zip, &localHeader, filename, len) != Z_OK)
+    if (jzReadLocalFileHeaderExtra(zip, &localHeader, filename, len, extra) != Z_OK)
         return Z_ERRNO;
 
-    memcpy(header, &localHeader.compressionMethod, sizeof(JZFileHeader));
+    header->compressionMethod = localHeader.compressionMethod;
+    header->lastModFileTime = localHeader.lastModFileTime;
+    header->lastModFileDate = localHeader.lastModFileDate;
+    header->crc32 = localHeader.crc32;
+    header->compressedSize = localHeader.compressedSize;
+    header->uncompressedSize = localHeader.uncompressedSize;
     header->offset = 0;  // not used in local context
+    jzReadZip64Extra(extra, localHeader.extraFieldLength, header, 0);
+
+    if (header->compressionMethod == 0 &&
+        (header->compressedSize != header->uncompressedSize))
+        return Z_ERRNO;
 
     return Z_OK;
 }
 
-// Read data from file stream, described by header, to preallocated buffer
+// Read data from file stream, described by header, to preallocated buffer.
+// The crc of the data is computed on each chunk as it is read or inflated, while it is still in
+// the cache, and checked against header->crc32.
 int jzReadData(JZFile *zip, JZFileHeader *header, void *buffer) {
-#ifdef HAVE_ZLIB
+    return jzReadDataPrefix(zip, header, buffer, header->uncompressedSize);
+}
+
+// Same, stopping once limit bytes are produced
+int jzReadDataPrefix(JZFile *zip, JZFileHeader *header, void *buffer, size_t limit) {
     unsigned char *bytes = (unsigned char *)buffer;  // cast
-    long compressedLeft, uncompressedLeft;
+    uint32_t crc = 0;
+
+    if (limit > header->uncompressedSize)
+        limit = header->uncompressedSize;
+#ifdef HAVE_ZLIB
+    unsigned char jzBuffer[JZ_BUFFER_SIZE];
+    const unsigned char *mapped = NULL;
+    uint64_t compressedLeft, uncompressedLeft;
+    size_t produced;
     int ret;
     z_stream strm;
 #endif
 
     if (header->compressionMethod == 0) {  // Store - just read it
-        if (zip->read(zip, buffer, header->uncompressedSize) <
-                header->uncompressedSize ||
-            zip->error(zip))
-            return Z_ERRNO;
+        size_t left, n;
+
+        for (left = limit; left; left -= n) {
+            n = left < JZ_CRC_CHUNK ? left : JZ_CRC_CHUNK;
+            if (zip->read(zip, bytes, n) < n || zip->error(zip))
+                return Z_ERRNO;
+            crc = crc32_update(crc, bytes, n);
+            bytes += n;
+        }
 #ifdef HAVE_ZLIB
     } else if (header->compressionMethod == 8) {  // Deflate - using zlib
         strm.zalloc = Z_NULL;
@@ -192,48 +349,66 @@ int jzReadData(JZFile *zip, JZFileHeader *header, void *buffer) {
         if ((ret = inflateInit2(&strm, -MAX_WBITS)) != Z_OK)
             return ret;  // Zlib errors are negative
 
-        // Inflate compressed data
-        for (compressedLeft = header->compressedSize,
-            uncompressedLeft = header->uncompressedSize;
-             compressedLeft && uncompressedLeft && ret != Z_STREAM_END;
-             compressedLeft -= strm.avail_in) {
-            // Read next chunk
-            strm.avail_in = zip->read(zip, jzBuffer,
-                                      (sizeof(jzBuffer) < compressedLeft) ? sizeof(jzBuffer) : compressedLeft);
-
-            if (strm.avail_in == 0 || zip->error(zip)) {
-                inflateEnd(&strm);
-                return Z_ERRNO;
+        // Memory mapped: inflate straight from the mapping, nothing to read
+        compressedLeft = header->compressedSize;
+        if (zip->map && compressedLeft <= SIZE_MAX)
+            mapped = zip->map(zip, compressedLeft);
+
+        // Inflate JZ_CRC_CHUNK bytes at a time, the stream is dropped once limit bytes are out
+        strm.next_out = bytes;
+        for (uncompressedLeft = limit; uncompressedLeft && ret != Z_STREAM_END; uncompressedLeft -= produced) {
+            if (strm.avail_in == 0) {
+                if (!compressedLeft)
+                    break;  // truncated stream
+
+                if (mapped) {
+                    // Next piece of the mapping, entries past 4 GB do not fit in avail_in at once
+                    strm.avail_in = (JZ_MAP_CHUNK < compressedLeft) ? JZ_MAP_CHUNK : compressedLeft;
+                    strm.next_in = (unsigned char *)mapped;
+                    mapped += strm.avail_in;
+                } else {
+                    // Read next chunk
+                    strm.avail_in = zip->read(zip, jzBuffer,
+                                              (sizeof(jzBuffer) < compressedLeft) ? sizeof(jzBuffer) : compressedLeft);
+
+                    if (strm.avail_in == 0 || zip->error(zip)) {
+                        inflateEnd(&strm);
+                        return Z_ERRNO;
+                    }
+
+                    strm.next_in = jzBuffer;
+                }
+                compressedLeft -= strm.avail_in;
             }
 
-            strm.next_in = jzBuffer;
-            strm.avail_out = uncompressedLeft;
-            strm.next_out = bytes;
-
-            compressedLeft -= strm.avail_in;  // inflate will change avail_in
+            strm.avail_out = uncompressedLeft < JZ_CRC_CHUNK ? uncompressedLeft : JZ_CRC_CHUNK;
 
             ret = inflate(&strm, Z_NO_FLUSH);
 
-            if (ret == Z_STREAM_ERROR) return ret;  // shouldn't happen
-
             switch (ret) {
                 case Z_NEED_DICT:
+                case Z_BUF_ERROR:
                     ret = Z_DATA_ERROR; /* and fall through */
+                case Z_STREAM_ERROR:
                 case Z_DATA_ERROR:
                 case Z_MEM_ERROR:
                     (void)inflateEnd(&strm);
                     return ret;
             }
 
-            bytes += uncompressedLeft - strm.avail_out;  // bytes uncompressed
-            uncompressedLeft = strm.avail_out;
+            produced = strm.next_out - bytes;  // bytes uncompressed
+            crc = crc32_update(crc, bytes, produced);
+            bytes = strm.next_out;
         }
 
         inflateEnd(&strm);
+
+        if (uncompressedLeft)
+            return Z_DATA_ERROR;
 #else
 #ifdef HAVE_PUFF
     } else if (header->compressionMethod == 8) {  // Deflate - using puff()
-        unsigned long destlen = header->uncompressedSize,
+        unsigned long destlen = limit,
                       sourcelen = header->compressedSize;
         unsigned char *comp = (unsigned char *)malloc(sourcelen);
         if (comp == NULL) return Z_ERRNO;  // couldn't allocate
@@ -241,13 +416,28 @@ int jzReadData(JZFile *zip, JZFileHeader *header, void *buffer) {
         if (read != sourcelen) return Z_ERRNO;  // TODO: more robust read loop
         int ret = puff((unsigned char *)buffer, &destlen, comp, &sourcelen);
         free(comp);
-        if (ret) return Z_ERRNO;  // something went wrong
+        if (ret && !(ret == 1 && limit < header->uncompressedSize))
+            return Z_ERRNO;  // something went wrong, other than running out of output space
+        crc = crc32_update(crc, buffer, destlen);
 #endif  // HAVE_PUFF
 #endif
     } else {
         return Z_ERRNO;
     }
 
+    if (limit == header->uncompressedSize && crc != header->crc32)
+        return JZ_CRC_ERROR;
+
+    return Z_OK;
+}
+
+int jzMapData(JZFile *zip, JZFileHeader *header, const void **data) {
+    if (header->compressionMethod != 0 || !zip->map)
+        return Z_ERRNO;
+
+    if (header->uncompressedSize > SIZE_MAX || !(*data = zip->map(zip, header->uncompressedSize)))
+        return Z_ERRNO;
+
     return Z_OK;
 }
 
@@ -265,13 +455,13 @@ stdio_read_file_handle_read(JZFile *file, void *buf, size_t size) {
 static size_t
 stdio_read_file_handle_tell(JZFile *file) {
     StdioJZFile *handle = (StdioJZFile *)file;
-    return ftell(handle->fp);
+    return jz_ftell(handle->fp);
 }
 
 static int
 stdio_read_file_handle_seek(JZFile *file, size_t offset, int whence) {
     StdioJZFile *handle = (StdioJZFile *)file;
-    return fseek(handle->fp, offset, whence);
+    return jz_fseek(handle->fp, offset, whence);
 }
 
 static int
@@ -296,7 +486,131 @@ jzfile_from_stdio_file(FILE *fp) {
     handle->handle.seek = stdio_read_file_handle_seek;
     handle->handle.error = stdio_read_file_handle_error;
     handle->handle.close = stdio_read_file_handle_close;
+    handle->handle.map = NULL;
+    handle->handle.dup = NULL;
+    handle->fp = fp;
+
+    return &(handle->handle);
+}
+
+#if !defined(_WIN32) && !defined(_WIN64)
+
+typedef struct {
+    JZFile handle;
+    FILE *fp;
+    const unsigned char *base;
+    size_t size;
+    size_t position;
+    int owner;  // 0 for handles created by dup(), which share the mapping
+} MmapJZFile;
+
+static size_t
+mmap_file_handle_read(JZFile *file, void *buf, size_t size) {
+    MmapJZFile *handle = (MmapJZFile *)file;
+    if (handle->position >= handle->size)
+        return 0;
+    if (size > handle->size - handle->position)
+        size = handle->size - handle->position;
+    memcpy(buf, handle->base + handle->position, size);
+    handle->position += size;
+    return size;
+}
+
+static size_t
+mmap_file_handle_tell(JZFile *file) {
+    MmapJZFile *handle = (MmapJZFile *)file;
+    return handle->position;
+}
+
+static int
+mmap_file_handle_seek(JZFile *file, size_t offset, int whence) {
+    MmapJZFile *handle = (MmapJZFile *)file;
+    size_t position;
+
+    switch (whence) {
+        case SEEK_SET: position = offset; break;
+        case SEEK_CUR: position = handle->position + offset; break;
+        case SEEK_END: position = handle->size + offset; break;
+        default: return -1;
+    }
+    if (position > handle->size)
+        return -1;
+    handle->position = position;
+    return 0;
+}
+
+static int
+mmap_file_handle_error(JZFile *file) {
+    return 0;
+}
+
+static void
+mmap_file_handle_close(JZFile *file) {
+    MmapJZFile *handle = (MmapJZFile *)file;
+    if (handle->owner) {
+        munmap((void *)handle->base, handle->size);
+        fclose(handle->fp);
+    }
+    free(file);
+}
+
+static const unsigned char *
+mmap_file_handle_map(JZFile *file, size_t size) {
+    MmapJZFile *handle = (MmapJZFile *)file;
+    const unsigned char *data;
+
+    if (handle->position > handle->size || size > handle->size - handle->position)
+        return NULL;
+    data = handle->base + handle->position;
+    handle->position += size;
+    return data;
+}
+
+static JZFile *
+mmap_file_handle_dup(JZFile *file) {
+    MmapJZFile *handle = (MmapJZFile *)malloc(sizeof(MmapJZFile));
+
+    memcpy(handle, file, sizeof(MmapJZFile));
+    handle->position = 0;
+    handle->owner = 0;
+
+    return &(handle->handle);
+}
+
+JZFile *
+jzfile_from_mmap_file(FILE *fp) {
+    MmapJZFile *handle;
+    struct stat st;
+    void *base;
+
+    if (fstat(fileno(fp), &st) || st.st_size <= 0 || (uintmax_t)st.st_size > SIZE_MAX)
+        return NULL;
+    if ((base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0)) == MAP_FAILED)
+        return NULL;
+
+    handle = (MmapJZFile *)malloc(sizeof(MmapJZFile));
+    handle->handle.read = mmap_file_handle_read;
+    handle->handle.tell = mmap_file_handle_tell;
+    handle->handle.seek = mmap_file_handle_seek;
+    handle->handle.error = mmap_file_handle_error;
+    handle->handle.close = mmap_file_handle_close;
+    handle->handle.map = mmap_file_handle_map;
+    handle->handle.dup = mmap_file_handle_dup;
     handle->fp = fp;
+    handle->base = (const unsigned char *)base;
+    handle->size = st.st_size;
+    handle->position = 0;
+    handle->owner = -1;
 
     return &(handle->handle);
 }
+
+#else
+
+// No mmap() on Windows: callers fall back to jzfile_from_stdio_file()
+JZFile *
+jzfile_from_mmap_file(FILE *fp) {
+    return NULL;
+}
+
+#endif
@@ -49,11 +49,22 @@ struct JZFile {
     int (*seek)(JZFile *file, size_t offset, int whence);
     int (*error)(JZFile *file);
     void (*close)(JZFile *file);
+    // Optional: return a pointer to the next size bytes and move past them,
+    // or NULL if not possible. NULL for handles that are not memory mapped.
+    const unsigned char *(*map)(JZFile *file, size_t size);
+    // Optional: return a new handle on the same data with its own position, so
+    // that several threads can read the file at once. NULL if not supported.
+    JZFile *(*dup)(JZFile *file);
 };
 
 JZFile *
 jzfile_from_stdio_file(FILE *fp);
 
+// Memory map the whole file. Returns NULL if mapping is not possible, in which
+// case fp is left untouched. Otherwise fp is closed along with the handle.
+JZFile *
+jzfile_from_mmap_file(FILE *fp);
+
 typedef struct __attribute__((__packed__)) {
     uint32_t signature;               // 0x04034B50
     uint16_t versionNeededToExtract;  // unsupported
@@ -65,7 +76,7 @@ typedef struct __attribute__((__packed__)) {
     uint32_t compressedSize;
     uint32_t uncompressedSize;
     uint16_t fileNameLength;
-    uint16_t extraFieldLength;  // unsupported
+    uint16_t extraFieldLength;  // Zip64 extra field only
 } JZLocalFileHeader;
 
 typedef struct __attribute__((__packed__)) {
@@ -80,7 +91,7 @@ typedef struct __attribute__((__packed__)) {
     uint32_t compressedSize;
     uint32_t uncompressedSize;
     uint16_t fileNameLength;
-    uint16_t extraFieldLength;        // unsupported
+    uint16_t extraFieldLength;        // Zip64 extra field only
     uint16_t fileCommentLength;       // unsupported
     uint16_t diskNumberStart;         // unsupported
     uint16_t internalFileAttributes;  // unsupported
@@ -88,14 +99,15 @@ typedef struct __attribute__((__packed__)) {
     uint32_t relativeOffsetOflocalHeader;
 } JZGlobalFileHeader;
 
+// Sizes and offset are 64 bits wide: Zip64 values from the extra field replace the 32 bit ones
 typedef struct __attribute__((__packed__)) {
     uint16_t compressionMethod;
     uint16_t lastModFileTime;
     uint16_t lastModFileDate;
     uint32_t crc32;
-    uint32_t compressedSize;
-    uint32_t uncompressedSize;
-    uint32_t offset;
+    uint64_t compressedSize;
+    uint64_t uncompressedSize;
+    uint64_t offset;
 } JZFileHeader;
 
 typedef struct __attribute__((__packed__)) {
@@ -108,6 +120,35 @@ typedef struct __attribute__((__packed__)) {
     uint32_t centralDirectoryOffset;
     uint16_t zipCommentLength;
     // Followed by .ZIP file comment (variable size)
+} JZEndRecord32;
+
+// Zip64: right before the end record when the archive has one of the two below
+typedef struct __attribute__((__packed__)) {
+    uint32_t signature;                  // 0x07064b50
+    uint32_t endRecordDiskNumber;        // unsupported
+    uint64_t endRecordOffset;
+    uint32_t numDisks;                   // unsupported
+} JZEndLocator64;
+
+typedef struct __attribute__((__packed__)) {
+    uint32_t signature;                   // 0x06064b50
+    uint64_t endRecordSize;               // unsupported
+    uint16_t versionMadeBy;               // unsupported
+    uint16_t versionNeededToExtract;      // unsupported
+    uint32_t diskNumber;                  // unsupported
+    uint32_t centralDirectoryDiskNumber;  // unsupported
+    uint64_t numEntriesThisDisk;          // unsupported
+    uint64_t numEntries;
+    uint64_t centralDirectorySize;
+    uint64_t centralDirectoryOffset;
+    // Followed by the Zip64 extensible data sector (variable size)
+} JZEndRecord64;
+
+// End record as read by jzReadEndRecord(), from the Zip64 end record if there is one
+typedef struct {
+    uint64_t numEntries;
+    uint64_t centralDirectorySize;
+    uint64_t centralDirectoryOffset;
 } JZEndRecord;
 
 // Callback prototype for central and local file record reading functions
@@ -115,8 +156,13 @@ typedef int (*JZRecordCallback)(JZFile *zip, int index, JZFileHeader *header,
                                 char *filename, void *user_data);
 
 #define JZ_BUFFER_SIZE 65536
+#define JZ_CRC_CHUNK 65536  // bytes inflated between two crc updates
+#define JZ_MAP_CHUNK 0x40000000  // mapped bytes handed to zlib at once, avail_in is 32 bits
+
+// Returned by jzReadData() when the data does not match the crc of its header
+#define JZ_CRC_ERROR (-100)
 
-// Read ZIP file end record. Will move within file.
+// Read ZIP file end record, Zip64 or not. Will move within file.
 int jzReadEndRecord(JZFile *zip, JZEndRecord *endRecord);
 
 // Read ZIP file global directory. Will move within file.
@@ -133,9 +179,18 @@ int jzReadLocalFileHeaderRaw(JZFile *zip, JZLocalFileHeader *header,
                              char *filename, int len);
 
 // Read data from file stream, described by header, to preallocated buffer
-// Return value is zlib coded, e.g. Z_OK, or error code
+// Return value is zlib coded, e.g. Z_OK, or error code, JZ_CRC_ERROR if the
+// data does not match header->crc32
 int jzReadData(JZFile *zip, JZFileHeader *header, void *buffer);
 
+// Same as above, for the first limit bytes only: inflate stops there. The crc
+// is only checked when limit covers the whole entry.
+int jzReadDataPrefix(JZFile *zip, JZFileHeader *header, void *buffer, size_t limit);
+
+// Get a pointer to the data of a stored entry without copying it. Only
+// possible with memory mapped handles, returns Z_ERRNO otherwise.
+int jzMapData(JZFile *zip, JZFileHeader *header, const void **data);
+
 #ifdef __cplusplus
 };
 #endif /* __cplusplus */
@@ -4,9 +4,12 @@
 #include <unistd.h>
 
 #include "arc.h"
+#include "digest.h"
 #include "mra.h"
+#include "pool.h"
 #include "rom.h"
 #include "utils.h"
+#include "zipindex.h"
 
 #define MAX_ROM_FILENAME_SIZE 16
 
@@ -18,11 +21,17 @@ extern char *sha1;
 
 int trace = 0;
 int verbose = 0;
+int threads = 0;
+size_t cache_budget = 256l * 1024l * 1024l;
+char *cache_dir = NULL;
+int low_memory = 0;
+int digests = 0;
 char *rom_basename = NULL;
 
 void print_usage() {
-    printf("\nUsage:\n\tmra [-vlzoOaA] [my_file.mra]...\n");
+    printf("\nUsage:\n\tmra [-vlzoOaAjmcLH] [my_file.mra]...\n\tmra index [directory]...\n");
     printf("\nConvert a number of MRA files to ROM files for use on MiST arcade cores.\nOptionally creates the associated ARC file.\n");
+    printf("\"mra index\" lists the zip files of directories in a %s file, read instead of the zip files directories afterwards.\n", ZIPINDEX_FILENAME);
     printf("For more informations, visit https://www.atari-forum.com/viewtopic.php?t=38224\n\n");
     printf("Options:\n\t-h\t\tthis help.\n");
     printf("\t-v\t\twhen it is the only parameter, display version information and exit. Otherwise, set Verbose on (default: off).\n");
@@ -33,6 +42,11 @@ void print_usage() {
     printf("\t-a filename\tset the output ARC file name. Overrides the internal generation of the filename.\n");
     printf("\t-A\t\tcreate ARC file. This is done in addition to creating the ROM file.\n");
     printf("\t-s\t\tskip ROM creation. This is useful if only the ARC file is required.\n");
+    printf("\t-j threads\tset the number of threads used to uncompress zip files (default: number of CPUs).\n");
+    printf("\t-m megabytes\tset the memory used to keep uncompressed zip entries from one ROM to the next (default: 256, 0 to disable).\n");
+    printf("\t-c directory\tkeep uncompressed zip entries in directory, to reuse them in later runs.\n");
+    printf("\t-L\t\tlow memory: write ROM files as they are assembled instead of assembling them in memory first.\n");
+    printf("\t-H digests\tprint the digests of each ROM file, a comma separated list of md5, crc32 and sha1.\n");
 }
 
 void print_version() {
@@ -66,12 +80,24 @@ void main(int argc, char **argv) {
         print_version();
         exit(EXIT_SUCCESS);
     }
+    if (argc >= 2 && !strcmp(argv[1], "index")) {
+        if (argc == 2) {
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+        for (i = 2; i < argc; i++) {
+            if (zipindex_write(replace_backslash(argv[i]))) {
+                exit(EXIT_FAILURE);
+            }
+        }
+        exit(EXIT_SUCCESS);
+    }
 
     int opt;
     // put ':' in the starting of the
     // string so that program can
     //distinguish between '?' and ':'
-    while ((opt = getopt(argc, argv, ":vlhAo:a:O:z:s")) != -1) {
+    while ((opt = getopt(argc, argv, ":vlhAo:a:O:z:sj:m:c:LH:")) != -1) {
         switch (opt) {
             case 'v':
                 verbose = -1;
@@ -97,6 +123,31 @@ void main(int argc, char **argv) {
             case 's':
                 dump_rom = 0;
                 break;
+            case 'j':
+                threads = atoi(optarg);
+                if (threads < 1) {
+                    printf("invalid number of threads: %s\n", optarg);
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                cache_dir = replace_backslash(strndup(optarg, 1024));
+                break;
+            case 'L':
+                low_memory = -1;
+                break;
+            case 'H':
+                digests = digest_parse(optarg);
+                if (digests <= 0) {
+                    printf("invalid digests: %s\n", optarg);
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                cache_budget = strtoul(optarg, NULL, 0) * 1024l * 1024l;
+                break;
             case 'h':
                 print_usage();
                 exit(EXIT_SUCCESS);
@@ -117,7 +168,17 @@ void main(int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
 
+    if (!threads) {
+        threads = get_cpu_count();
+    }
+
+    if (cache_dir && !file_exists(cache_dir)) {
+        printf("error: cache directory not found (%s)\n", cache_dir);
+        exit(EXIT_FAILURE);
+    }
+
     if( argc-optind > 1 ) {
+        set_md5_batch();
         free( rom_filename );
         free( arc_filename );
         rom_filename = NULL;
@@ -239,6 +300,7 @@ void main(int argc, char **argv) {
         string_list_free(dirs);
         free(dirs);
     }
+    flush_md5_batch();
     if (verbose) {
         printf("done!\n");
     }
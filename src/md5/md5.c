@@ -203,6 +203,226 @@ static const void *body(MD5_CTX *ctx, const void *data, unsigned long size) {
     return ptr;
 }
 
+/*
+ * A tuned body for the hosts the ROM builds run on.  It computes the same
+ * function as body() above, but reads the 16 message words into locals once
+ * per block, adds the two terms of G separately (they never share a bit) so
+ * the additions can overlap, and rotates with a 32-bit expression compilers
+ * turn into a single instruction.  Built a second time with BMI enabled, the
+ * ~x & y terms become ANDN.  MD5_Use_Body() picks the variant.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define MD5_X86_BODY
+#endif
+
+#define ROTL32(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+
+#define TSTEP_F(a, b, c, d, x, t, s)           \
+    (a) += (x) + (t) + F((b), (c), (d));       \
+    (a) = ROTL32((a), (s)) + (b);
+#define TSTEP_G(a, b, c, d, x, t, s)           \
+    (a) += (x) + (t) + (~(d) & (c));           \
+    (a) += (d) & (b);                          \
+    (a) = ROTL32((a), (s)) + (b);
+#define TSTEP_H(a, b, c, d, x, t, s)           \
+    (a) += (x) + (t) + ((b) ^ (c) ^ (d));      \
+    (a) = ROTL32((a), (s)) + (b);
+#define TSTEP_I(a, b, c, d, x, t, s)           \
+    (a) += (x) + (t) + ((c) ^ ((b) | ~(d)));   \
+    (a) = ROTL32((a), (s)) + (b);
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define LOAD(n, x) memcpy(&(x), &ptr[(n)*4], 4);
+#else
+#define LOAD(n, x)                               \
+    (x) = (unsigned int)ptr[(n)*4] |             \
+          ((unsigned int)ptr[(n)*4 + 1] << 8) |  \
+          ((unsigned int)ptr[(n)*4 + 2] << 16) | \
+          ((unsigned int)ptr[(n)*4 + 3] << 24);
+#endif
+
+#ifdef __GNUC__
+__attribute__((always_inline))
+#endif
+static inline const void *tuned_body(MD5_CTX *ctx, const void *data, unsigned long size) {
+    const unsigned char *ptr;
+    unsigned int a, b, c, d;
+    unsigned int saved_a, saved_b, saved_c, saved_d;
+    unsigned int X0, X1, X2, X3, X4, X5, X6, X7, X8, X9, X10, X11, X12, X13, X14, X15;
+
+    ptr = (const unsigned char *)data;
+
+    a = ctx->a;
+    b = ctx->b;
+    c = ctx->c;
+    d = ctx->d;
+
+    do {
+        saved_a = a;
+        saved_b = b;
+        saved_c = c;
+        saved_d = d;
+
+        LOAD(0, X0) LOAD(1, X1) LOAD(2, X2) LOAD(3, X3)
+        LOAD(4, X4) LOAD(5, X5) LOAD(6, X6) LOAD(7, X7)
+        LOAD(8, X8) LOAD(9, X9) LOAD(10, X10) LOAD(11, X11)
+        LOAD(12, X12) LOAD(13, X13) LOAD(14, X14) LOAD(15, X15)
+
+        /* Round 1 */
+        TSTEP_F(a, b, c, d, X0, 0xd76aa478, 7)
+        TSTEP_F(d, a, b, c, X1, 0xe8c7b756, 12)
+        TSTEP_F(c, d, a, b, X2, 0x242070db, 17)
+        TSTEP_F(b, c, d, a, X3, 0xc1bdceee, 22)
+        TSTEP_F(a, b, c, d, X4, 0xf57c0faf, 7)
+        TSTEP_F(d, a, b, c, X5, 0x4787c62a, 12)
+        TSTEP_F(c, d, a, b, X6, 0xa8304613, 17)
+        TSTEP_F(b, c, d, a, X7, 0xfd469501, 22)
+        TSTEP_F(a, b, c, d, X8, 0x698098d8, 7)
+        TSTEP_F(d, a, b, c, X9, 0x8b44f7af, 12)
+        TSTEP_F(c, d, a, b, X10, 0xffff5bb1, 17)
+        TSTEP_F(b, c, d, a, X11, 0x895cd7be, 22)
+        TSTEP_F(a, b, c, d, X12, 0x6b901122, 7)
+        TSTEP_F(d, a, b, c, X13, 0xfd987193, 12)
+        TSTEP_F(c, d, a, b, X14, 0xa679438e, 17)
+        TSTEP_F(b, c, d, a, X15, 0x49b40821, 22)
+
+        /* Round 2 */
+        TSTEP_G(a, b, c, d, X1, 0xf61e2562, 5)
+        TSTEP_G(d, a, b, c, X6, 0xc040b340, 9)
+        TSTEP_G(c, d, a, b, X11, 0x265e5a51, 14)
+        TSTEP_G(b, c, d, a, X0, 0xe9b6c7aa, 20)
+        TSTEP_G(a, b, c, d, X5, 0xd62f105d, 5)
+        TSTEP_G(d, a, b, c, X10, 0x02441453, 9)
+        TSTEP_G(c, d, a, b, X15, 0xd8a1e681, 14)
+        TSTEP_G(b, c, d, a, X4, 0xe7d3fbc8, 20)
+        TSTEP_G(a, b, c, d, X9, 0x21e1cde6, 5)
+        TSTEP_G(d, a, b, c, X14, 0xc33707d6, 9)
+        TSTEP_G(c, d, a, b, X3, 0xf4d50d87, 14)
+        TSTEP_G(b, c, d, a, X8, 0x455a14ed, 20)
+        TSTEP_G(a, b, c, d, X13, 0xa9e3e905, 5)
+        TSTEP_G(d, a, b, c, X2, 0xfcefa3f8, 9)
+        TSTEP_G(c, d, a, b, X7, 0x676f02d9, 14)
+        TSTEP_G(b, c, d, a, X12, 0x8d2a4c8a, 20)
+
+        /* Round 3 */
+        TSTEP_H(a, b, c, d, X5, 0xfffa3942, 4)
+        TSTEP_H(d, a, b, c, X8, 0x8771f681, 11)
+        TSTEP_H(c, d, a, b, X11, 0x6d9d6122, 16)
+        TSTEP_H(b, c, d, a, X14, 0xfde5380c, 23)
+        TSTEP_H(a, b, c, d, X1, 0xa4beea44, 4)
+        TSTEP_H(d, a, b, c, X4, 0x4bdecfa9, 11)
+        TSTEP_H(c, d, a, b, X7, 0xf6bb4b60, 16)
+        TSTEP_H(b, c, d, a, X10, 0xbebfbc70, 23)
+        TSTEP_H(a, b, c, d, X13, 0x289b7ec6, 4)
+        TSTEP_H(d, a, b, c, X0, 0xeaa127fa, 11)
+        TSTEP_H(c, d, a, b, X3, 0xd4ef3085, 16)
+        TSTEP_H(b, c, d, a, X6, 0x04881d05, 23)
+        TSTEP_H(a, b, c, d, X9, 0xd9d4d039, 4)
+        TSTEP_H(d, a, b, c, X12, 0xe6db99e5, 11)
+        TSTEP_H(c, d, a, b, X15, 0x1fa27cf8, 16)
+        TSTEP_H(b, c, d, a, X2, 0xc4ac5665, 23)
+
+        /* Round 4 */
+        TSTEP_I(a, b, c, d, X0, 0xf4292244, 6)
+        TSTEP_I(d, a, b, c, X7, 0x432aff97, 10)
+        TSTEP_I(c, d, a, b, X14, 0xab9423a7, 15)
+        TSTEP_I(b, c, d, a, X5, 0xfc93a039, 21)
+        TSTEP_I(a, b, c, d, X12, 0x655b59c3, 6)
+        TSTEP_I(d, a, b, c, X3, 0x8f0ccc92, 10)
+        TSTEP_I(c, d, a, b, X10, 0xffeff47d, 15)
+        TSTEP_I(b, c, d, a, X1, 0x85845dd1, 21)
+        TSTEP_I(a, b, c, d, X8, 0x6fa87e4f, 6)
+        TSTEP_I(d, a, b, c, X15, 0xfe2ce6e0, 10)
+        TSTEP_I(c, d, a, b, X6, 0xa3014314, 15)
+        TSTEP_I(b, c, d, a, X13, 0x4e0811a1, 21)
+        TSTEP_I(a, b, c, d, X4, 0xf7537e82, 6)
+        TSTEP_I(d, a, b, c, X11, 0xbd3af235, 10)
+        TSTEP_I(c, d, a, b, X2, 0x2ad7d2bb, 15)
+        TSTEP_I(b, c, d, a, X9, 0xeb86d391, 21)
+
+        a += saved_a;
+        b += saved_b;
+        c += saved_c;
+        d += saved_d;
+
+        ptr += 64;
+    } while (size -= 64);
+
+    ctx->a = a;
+    ctx->b = b;
+    ctx->c = c;
+    ctx->d = d;
+
+    return ptr;
+}
+
+static const void *body_tuned(MD5_CTX *ctx, const void *data, unsigned long size) {
+    return tuned_body(ctx, data, size);
+}
+
+#ifdef MD5_X86_BODY
+__attribute__((target("bmi")))
+static const void *body_bmi(MD5_CTX *ctx, const void *data, unsigned long size) {
+    return tuned_body(ctx, data, size);
+}
+#endif
+
+typedef const void *(*t_body)(MD5_CTX *ctx, const void *data, unsigned long size);
+static t_body body_fn = NULL;
+
+int MD5_Use_Body(int variant) {
+    t_body fn;
+
+    switch (variant) {
+        case MD5_BODY_AUTO:
+            fn = body_tuned;
+#ifdef MD5_X86_BODY
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("bmi"))
+                fn = body_bmi;
+#endif
+            break;
+        case MD5_BODY_REFERENCE:
+            fn = body;
+            break;
+        case MD5_BODY_TUNED:
+            fn = body_tuned;
+            break;
+        case MD5_BODY_BMI:
+#ifdef MD5_X86_BODY
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("bmi")) {
+                fn = body_bmi;
+                break;
+            }
+#endif
+            return -1;
+        default:
+            return -1;
+    }
+#ifdef __GNUC__
+    __atomic_store_n(&body_fn, fn, __ATOMIC_RELAXED);
+#else
+    body_fn = fn;
+#endif
+    return 0;
+}
+
+static t_body select_body() {
+    t_body fn;
+
+#ifdef __GNUC__
+    fn = __atomic_load_n(&body_fn, __ATOMIC_RELAXED);
+#else
+    fn = body_fn;
+#endif
+    if (!fn) {
+        MD5_Use_Body(MD5_BODY_AUTO);
+        fn = body_fn;
+    }
+    return fn;
+}
+
 void MD5_Init(MD5_CTX *ctx) {
     ctx->a = 0x67452301;
     ctx->b = 0xefcdab89;
@@ -214,6 +434,7 @@ void MD5_Init(MD5_CTX *ctx) {
 }
 
 void MD5_Update(MD5_CTX *ctx, const void *data, unsigned long size) {
+    t_body fn = select_body();
     MD5_u32plus saved_lo;
     unsigned long used, available;
 
@@ -235,11 +456,11 @@ void MD5_Update(MD5_CTX *ctx, const void *data, unsigned long size) {
         memcpy(&ctx->buffer[used], data, available);
         data = (const unsigned char *)data + available;
         size -= available;
-        body(ctx, ctx->buffer, 64);
+        fn(ctx, ctx->buffer, 64);
     }
 
     if (size >= 64) {
-        data = body(ctx, data, size & ~(unsigned long)0x3f);
+        data = fn(ctx, data, size & ~(unsigned long)0x3f);
         size &= 0x3f;
     }
 
@@ -253,6 +474,7 @@ void MD5_Update(MD5_CTX *ctx, const void *data, unsigned long size) {
     (dst)[3] = (unsigned char)((src) >> 24);
 
 void MD5_Final(unsigned char *result, MD5_CTX *ctx) {
+    t_body fn = select_body();
     unsigned long used, available;
 
     used = ctx->lo & 0x3f;
@@ -263,7 +485,7 @@ void MD5_Final(unsigned char *result, MD5_CTX *ctx) {
 
     if (available < 8) {
         memset(&ctx->buffer[used], 0, available);
-        body(ctx, ctx->buffer, 64);
+        fn(ctx, ctx->buffer, 64);
         used = 0;
         available = 64;
     }
@@ -274,7 +496,7 @@ void MD5_Final(unsigned char *result, MD5_CTX *ctx) {
     OUT(&ctx->buffer[56], ctx->lo)
     OUT(&ctx->buffer[60], ctx->hi)
 
-    body(ctx, ctx->buffer, 64);
+    fn(ctx, ctx->buffer, 64);
 
     OUT(&result[0], ctx->a)
     OUT(&result[4], ctx->b)
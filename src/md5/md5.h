@@ -42,4 +42,16 @@ extern void MD5_Init(MD5_CTX *ctx);
 extern void MD5_Update(MD5_CTX *ctx, const void *data, unsigned long size);
 extern void MD5_Final(unsigned char *result, MD5_CTX *ctx);
 
+/*
+ * The block function is picked at runtime (MD5_BODY_AUTO) on first use.
+ * MD5_Use_Body() forces one, e.g. to compare them; it returns -1 when the
+ * variant can't run on this CPU.
+ */
+#define MD5_BODY_AUTO 0
+#define MD5_BODY_REFERENCE 1
+#define MD5_BODY_TUNED 2
+#define MD5_BODY_BMI 3
+
+extern int MD5_Use_Body(int variant);
+
 #endif
@@ -0,0 +1,287 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "md5.h"
+#include "md5batch.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(HAVE_OPENSSL)
+#define X86_KERNELS
+#include <immintrin.h>
+#endif
+
+/*
+    Multi-buffer MD5
+
+    MD5 is sequential within a buffer, but independent buffers can share the vector registers:
+    each 32 bits lane runs the same steps on the state of its own buffer. Lanes are fed with
+    whole 64 bytes blocks. When a buffer has less than a block left, the vendored MD5 takes over
+    from the state of its lane for the tail and the padding, and the lane moves to the next buffer.
+*/
+
+#define MD5_LANES 8  // lanes of the widest kernel
+
+// Run n_blocks blocks on all lanes. Lane l reads ptr[l] and moves it by step[l] after each block.
+typedef void (*t_md5_kernel)(uint32_t state[4][MD5_LANES], const unsigned char **ptr, const size_t *step, size_t n_blocks);
+
+#ifdef X86_KERNELS
+
+// Same 64 steps as md5.c, on vectors
+#define MD5_ROUNDS(STEP, F, G, H, I, a, b, c, d, X) \
+    STEP(F, a, b, c, d, X[0], 0xd76aa478, 7) \
+    STEP(F, d, a, b, c, X[1], 0xe8c7b756, 12) \
+    STEP(F, c, d, a, b, X[2], 0x242070db, 17) \
+    STEP(F, b, c, d, a, X[3], 0xc1bdceee, 22) \
+    STEP(F, a, b, c, d, X[4], 0xf57c0faf, 7) \
+    STEP(F, d, a, b, c, X[5], 0x4787c62a, 12) \
+    STEP(F, c, d, a, b, X[6], 0xa8304613, 17) \
+    STEP(F, b, c, d, a, X[7], 0xfd469501, 22) \
+    STEP(F, a, b, c, d, X[8], 0x698098d8, 7) \
+    STEP(F, d, a, b, c, X[9], 0x8b44f7af, 12) \
+    STEP(F, c, d, a, b, X[10], 0xffff5bb1, 17) \
+    STEP(F, b, c, d, a, X[11], 0x895cd7be, 22) \
+    STEP(F, a, b, c, d, X[12], 0x6b901122, 7) \
+    STEP(F, d, a, b, c, X[13], 0xfd987193, 12) \
+    STEP(F, c, d, a, b, X[14], 0xa679438e, 17) \
+    STEP(F, b, c, d, a, X[15], 0x49b40821, 22) \
+    STEP(G, a, b, c, d, X[1], 0xf61e2562, 5) \
+    STEP(G, d, a, b, c, X[6], 0xc040b340, 9) \
+    STEP(G, c, d, a, b, X[11], 0x265e5a51, 14) \
+    STEP(G, b, c, d, a, X[0], 0xe9b6c7aa, 20) \
+    STEP(G, a, b, c, d, X[5], 0xd62f105d, 5) \
+    STEP(G, d, a, b, c, X[10], 0x02441453, 9) \
+    STEP(G, c, d, a, b, X[15], 0xd8a1e681, 14) \
+    STEP(G, b, c, d, a, X[4], 0xe7d3fbc8, 20) \
+    STEP(G, a, b, c, d, X[9], 0x21e1cde6, 5) \
+    STEP(G, d, a, b, c, X[14], 0xc33707d6, 9) \
+    STEP(G, c, d, a, b, X[3], 0xf4d50d87, 14) \
+    STEP(G, b, c, d, a, X[8], 0x455a14ed, 20) \
+    STEP(G, a, b, c, d, X[13], 0xa9e3e905, 5) \
+    STEP(G, d, a, b, c, X[2], 0xfcefa3f8, 9) \
+    STEP(G, c, d, a, b, X[7], 0x676f02d9, 14) \
+    STEP(G, b, c, d, a, X[12], 0x8d2a4c8a, 20) \
+    STEP(H, a, b, c, d, X[5], 0xfffa3942, 4) \
+    STEP(H, d, a, b, c, X[8], 0x8771f681, 11) \
+    STEP(H, c, d, a, b, X[11], 0x6d9d6122, 16) \
+    STEP(H, b, c, d, a, X[14], 0xfde5380c, 23) \
+    STEP(H, a, b, c, d, X[1], 0xa4beea44, 4) \
+    STEP(H, d, a, b, c, X[4], 0x4bdecfa9, 11) \
+    STEP(H, c, d, a, b, X[7], 0xf6bb4b60, 16) \
+    STEP(H, b, c, d, a, X[10], 0xbebfbc70, 23) \
+    STEP(H, a, b, c, d, X[13], 0x289b7ec6, 4) \
+    STEP(H, d, a, b, c, X[0], 0xeaa127fa, 11) \
+    STEP(H, c, d, a, b, X[3], 0xd4ef3085, 16) \
+    STEP(H, b, c, d, a, X[6], 0x04881d05, 23) \
+    STEP(H, a, b, c, d, X[9], 0xd9d4d039, 4) \
+    STEP(H, d, a, b, c, X[12], 0xe6db99e5, 11) \
+    STEP(H, c, d, a, b, X[15], 0x1fa27cf8, 16) \
+    STEP(H, b, c, d, a, X[2], 0xc4ac5665, 23) \
+    STEP(I, a, b, c, d, X[0], 0xf4292244, 6) \
+    STEP(I, d, a, b, c, X[7], 0x432aff97, 10) \
+    STEP(I, c, d, a, b, X[14], 0xab9423a7, 15) \
+    STEP(I, b, c, d, a, X[5], 0xfc93a039, 21) \
+    STEP(I, a, b, c, d, X[12], 0x655b59c3, 6) \
+    STEP(I, d, a, b, c, X[3], 0x8f0ccc92, 10) \
+    STEP(I, c, d, a, b, X[10], 0xffeff47d, 15) \
+    STEP(I, b, c, d, a, X[1], 0x85845dd1, 21) \
+    STEP(I, a, b, c, d, X[8], 0x6fa87e4f, 6) \
+    STEP(I, d, a, b, c, X[15], 0xfe2ce6e0, 10) \
+    STEP(I, c, d, a, b, X[6], 0xa3014314, 15) \
+    STEP(I, b, c, d, a, X[13], 0x4e0811a1, 21) \
+    STEP(I, a, b, c, d, X[4], 0xf7537e82, 6) \
+    STEP(I, d, a, b, c, X[11], 0xbd3af235, 10) \
+    STEP(I, c, d, a, b, X[2], 0x2ad7d2bb, 15) \
+    STEP(I, b, c, d, a, X[9], 0xeb86d391, 21)
+
+/*
+    SSE2, 4 lanes
+*/
+
+#define SSE2_F(x, y, z) _mm_xor_si128(z, _mm_and_si128(x, _mm_xor_si128(y, z)))
+#define SSE2_G(x, y, z) _mm_xor_si128(y, _mm_and_si128(z, _mm_xor_si128(x, y)))
+#define SSE2_H(x, y, z) _mm_xor_si128(_mm_xor_si128(x, y), z)
+#define SSE2_I(x, y, z) _mm_xor_si128(y, _mm_or_si128(x, _mm_xor_si128(z, _mm_set1_epi32(-1))))
+#define SSE2_STEP(f, a, b, c, d, x, t, s)                                                         \
+    a = _mm_add_epi32(a, _mm_add_epi32(f(b, c, d), _mm_add_epi32(x, _mm_set1_epi32((int)t)))); \
+    a = _mm_or_si128(_mm_slli_epi32(a, s), _mm_srli_epi32(a, 32 - s));                       \
+    a = _mm_add_epi32(a, b);
+
+// Words 4k to 4k+3 of the blocks of 4 lanes, transposed so that X[i] holds word i of every lane
+__attribute__((target("sse2"))) static inline void sse2_load(__m128i *X, const unsigned char **ptr, int k) {
+    __m128i r0 = _mm_loadu_si128((const __m128i *)(ptr[0] + 16 * k));
+    __m128i r1 = _mm_loadu_si128((const __m128i *)(ptr[1] + 16 * k));
+    __m128i r2 = _mm_loadu_si128((const __m128i *)(ptr[2] + 16 * k));
+    __m128i r3 = _mm_loadu_si128((const __m128i *)(ptr[3] + 16 * k));
+    __m128i t0 = _mm_unpacklo_epi32(r0, r1), t1 = _mm_unpacklo_epi32(r2, r3);
+    __m128i t2 = _mm_unpackhi_epi32(r0, r1), t3 = _mm_unpackhi_epi32(r2, r3);
+
+    X[4 * k] = _mm_unpacklo_epi64(t0, t1);
+    X[4 * k + 1] = _mm_unpackhi_epi64(t0, t1);
+    X[4 * k + 2] = _mm_unpacklo_epi64(t2, t3);
+    X[4 * k + 3] = _mm_unpackhi_epi64(t2, t3);
+}
+
+__attribute__((target("sse2"))) static void sse2_kernel(uint32_t state[4][MD5_LANES], const unsigned char **ptr, const size_t *step, size_t n_blocks) {
+    __m128i a = _mm_loadu_si128((const __m128i *)state[0]);
+    __m128i b = _mm_loadu_si128((const __m128i *)state[1]);
+    __m128i c = _mm_loadu_si128((const __m128i *)state[2]);
+    __m128i d = _mm_loadu_si128((const __m128i *)state[3]);
+    __m128i X[16];
+
+    while (n_blocks--) {
+        __m128i saved_a = a, saved_b = b, saved_c = c, saved_d = d;
+
+        for (int k = 0; k < 4; k++) sse2_load(X, ptr, k);
+        for (int l = 0; l < 4; l++) ptr[l] += step[l];
+        MD5_ROUNDS(SSE2_STEP, SSE2_F, SSE2_G, SSE2_H, SSE2_I, a, b, c, d, X)
+        a = _mm_add_epi32(a, saved_a);
+        b = _mm_add_epi32(b, saved_b);
+        c = _mm_add_epi32(c, saved_c);
+        d = _mm_add_epi32(d, saved_d);
+    }
+    _mm_storeu_si128((__m128i *)state[0], a);
+    _mm_storeu_si128((__m128i *)state[1], b);
+    _mm_storeu_si128((__m128i *)state[2], c);
+    _mm_storeu_si128((__m128i *)state[3], d);
+}
+
+/*
+    AVX2, 8 lanes
+*/
+
+#define AVX2_F(x, y, z) _mm256_xor_si256(z, _mm256_and_si256(x, _mm256_xor_si256(y, z)))
+#define AVX2_G(x, y, z) _mm256_xor_si256(y, _mm256_and_si256(z, _mm256_xor_si256(x, y)))
+#define AVX2_H(x, y, z) _mm256_xor_si256(_mm256_xor_si256(x, y), z)
+#define AVX2_I(x, y, z) _mm256_xor_si256(y, _mm256_or_si256(x, _mm256_xor_si256(z, _mm256_set1_epi32(-1))))
+#define AVX2_STEP(f, a, b, c, d, x, t, s)                                                                  \
+    a = _mm256_add_epi32(a, _mm256_add_epi32(f(b, c, d), _mm256_add_epi32(x, _mm256_set1_epi32((int)t)))); \
+    a = _mm256_or_si256(_mm256_slli_epi32(a, s), _mm256_srli_epi32(a, 32 - s));                           \
+    a = _mm256_add_epi32(a, b);
+
+__attribute__((target("avx2"))) static void avx2_kernel(uint32_t state[4][MD5_LANES], const unsigned char **ptr, const size_t *step, size_t n_blocks) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)state[0]);
+    __m256i b = _mm256_loadu_si256((const __m256i *)state[1]);
+    __m256i c = _mm256_loadu_si256((const __m256i *)state[2]);
+    __m256i d = _mm256_loadu_si256((const __m256i *)state[3]);
+    __m128i lo[16], hi[16];
+    __m256i X[16];
+
+    while (n_blocks--) {
+        __m256i saved_a = a, saved_b = b, saved_c = c, saved_d = d;
+
+        // Lanes 0-3 and 4-7 are transposed as with SSE2, then put together
+        for (int k = 0; k < 4; k++) {
+            sse2_load(lo, ptr, k);
+            sse2_load(hi, ptr + 4, k);
+        }
+        for (int i = 0; i < 16; i++) X[i] = _mm256_inserti128_si256(_mm256_castsi128_si256(lo[i]), hi[i], 1);
+        for (int l = 0; l < 8; l++) ptr[l] += step[l];
+        MD5_ROUNDS(AVX2_STEP, AVX2_F, AVX2_G, AVX2_H, AVX2_I, a, b, c, d, X)
+        a = _mm256_add_epi32(a, saved_a);
+        b = _mm256_add_epi32(b, saved_b);
+        c = _mm256_add_epi32(c, saved_c);
+        d = _mm256_add_epi32(d, saved_d);
+    }
+    _mm256_storeu_si256((__m256i *)state[0], a);
+    _mm256_storeu_si256((__m256i *)state[1], b);
+    _mm256_storeu_si256((__m256i *)state[2], c);
+    _mm256_storeu_si256((__m256i *)state[3], d);
+}
+
+#endif
+
+// Kernel for the CPU we run on and its number of lanes, NULL if there is none
+static t_md5_kernel get_kernel(int *n_lanes) {
+#ifdef X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        *n_lanes = 8;
+        return avx2_kernel;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        *n_lanes = 4;
+        return sse2_kernel;
+    }
+#endif
+    *n_lanes = 1;
+    return NULL;
+}
+
+// The vendored MD5 hashes what is left of a buffer, from the state of its lane after done bytes
+static void finish_lane(uint32_t state[4][MD5_LANES], int lane, const unsigned char *data, size_t done, size_t length, unsigned char *md5) {
+    MD5_CTX ctx;
+
+    MD5_Init(&ctx);
+    if (done) {
+        ctx.a = state[0][lane];
+        ctx.b = state[1][lane];
+        ctx.c = state[2][lane];
+        ctx.d = state[3][lane];
+        ctx.lo = done & 0x1fffffff;
+        ctx.hi = (MD5_u32plus)(done >> 29);
+    }
+    MD5_Update(&ctx, data + done, length - done);
+    MD5_Final(md5, &ctx);
+}
+
+void md5_batch(int n, const unsigned char **data, const size_t *length, unsigned char (*md5)[16]) {
+    static const unsigned char idle_block[64];
+    uint32_t state[4][MD5_LANES];
+    const unsigned char *ptr[MD5_LANES];
+    size_t step[MD5_LANES], done[MD5_LANES];
+    int buffer[MD5_LANES];  // buffer of each lane, -1 when idle
+    int n_lanes, next = 0, l;
+    t_md5_kernel kernel = get_kernel(&n_lanes);
+
+    if (!kernel) {
+        for (int i = 0; i < n; i++) {
+            uint32_t none[4][MD5_LANES];
+            finish_lane(none, 0, data[i], 0, length[i], md5[i]);
+        }
+        return;
+    }
+
+    for (l = 0; l < MD5_LANES; l++) buffer[l] = -1;
+    for (;;) {
+        size_t n_blocks = SIZE_MAX;
+        int n_active = 0, lone;
+
+        // Idle lanes start on the next buffers
+        for (l = 0; l < n_lanes; l++) {
+            if (buffer[l] < 0 && next < n) {
+                buffer[l] = next++;
+                done[l] = 0;
+                state[0][l] = 0x67452301;
+                state[1][l] = 0xefcdab89;
+                state[2][l] = 0x98badcfe;
+                state[3][l] = 0x10325476;
+            }
+            if (buffer[l] >= 0) {
+                size_t blocks = (length[buffer[l]] - done[l]) / 64;
+                if (blocks < n_blocks) n_blocks = blocks;
+                n_active++;
+            }
+        }
+        if (!n_active) break;
+
+        // A lone buffer goes faster without the vector kernel
+        lone = n_active == 1 && next == n;
+        if (lone) n_blocks = 0;
+
+        if (n_blocks) {
+            for (l = 0; l < n_lanes; l++) {
+                ptr[l] = buffer[l] >= 0 ? data[buffer[l]] + done[l] : idle_block;
+                step[l] = buffer[l] >= 0 ? 64 : 0;
+            }
+            kernel(state, ptr, step, n_blocks);
+            for (l = 0; l < n_lanes; l++) done[l] += n_blocks * 64;
+        }
+
+        // Lanes that have less than a block left, or are alone, finish with the vendored MD5
+        for (l = 0; l < n_lanes; l++) {
+            if (buffer[l] >= 0 && (length[buffer[l]] - done[l] < 64 || lone)) {
+                finish_lane(state, l, data[buffer[l]], done[l], length[buffer[l]], md5[buffer[l]]);
+                buffer[l] = -1;
+            }
+        }
+    }
+}
@@ -0,0 +1,10 @@
+#ifndef _MD5BATCH_H_
+#define _MD5BATCH_H_
+
+#include <stddef.h>
+
+// md5 of n independent buffers. Buffers are hashed side by side, one per lane of the vector
+// registers (4 with SSE2, 8 with AVX2), or one after the other when there are no vector kernels.
+void md5_batch(int n, const unsigned char **data, const size_t *length, unsigned char (*md5)[16]);
+
+#endif
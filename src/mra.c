@@ -21,7 +21,7 @@ int read_patch(XMLNode *node, t_patch *patch) {
     for (j = 0; j < node->n_attributes; j++) {
         if (strncmp(node->attributes[j].name, "offset", 7) == 0) {
             // offset can be decimal or hexa with 0x prefix
-            patch->offset = strtoul(node->attributes[j].value, NULL, 0);
+            patch->offset = strtoull(node->attributes[j].value, NULL, 0);
         }
     }
     if (node->text != NULL) {
@@ -90,11 +90,11 @@ int read_part(XMLNode *node, t_part *part, int parent_index) {
             part->p.repeat = strtoul(node->attributes[j].value, NULL, 0);
         } else if (strncmp(node->attributes[j].name, "offset", 7) == 0) {
             // offset can be decimal or hexa with 0x prefix
-            part->p.offset = strtoul(node->attributes[j].value, NULL, 0);
+            part->p.offset = strtoull(node->attributes[j].value, NULL, 0);
         } else if (strncmp(node->attributes[j].name, "length", 7) == 0 ||
                    strncmp(node->attributes[j].name, "size", 5) == 0) {
             // length/size can be decimal or hexa with 0x prefix
-            part->p.length = strtoul(node->attributes[j].value, NULL, 0);
+            part->p.length = strtoull(node->attributes[j].value, NULL, 0);
         } else if (strncmp(node->attributes[j].name, "pattern", 8) == 0) {
             part->p.pattern = strndup(node->attributes[j].value, 256);
         } else if (strncmp(node->attributes[j].name, "map", 4) == 0) {
@@ -432,8 +432,8 @@ void dump_part(t_part *part) {
             printf("    _map_index: %d\n", part->p._map_index);
         }
         if (part->p.repeat) printf("    repeat: %u (0x%04x)\n", part->p.repeat, part->p.repeat);
-        if (part->p.offset) printf("    offset: %u (0x%04x)\n", part->p.offset, part->p.offset);
-        if (part->p.length) printf("    length: %u (0x%04x)\n", part->p.length, part->p.length);
+        if (part->p.offset) printf("    offset: %llu (0x%04llx)\n", (unsigned long long)part->p.offset, (unsigned long long)part->p.offset);
+        if (part->p.length) printf("    length: %llu (0x%04llx)\n", (unsigned long long)part->p.length, (unsigned long long)part->p.length);
         if (part->p.data_length) printf("    data_length: %lu\n", part->p.data_length);
     }
 }
@@ -482,7 +482,7 @@ int mra_dump(t_mra *mra) {
         if (rom->n_patches) printf("  ============\n");
         for (j = 0; j < rom->n_patches; j++) {
             printf("  patch[%d]:\n", j);
-            printf("    offset: %u (0x%08x)\n", rom->patches[j].offset, rom->patches[j].offset);
+            printf("    offset: %llu (0x%08llx)\n", (unsigned long long)rom->patches[j].offset, (unsigned long long)rom->patches[j].offset);
             printf("    data_length: %lu (0x%08lx)\n", rom->patches[j].data_length, rom->patches[j].data_length);
         }
     }
@@ -17,8 +17,8 @@ typedef struct s_part {
             char *zip;
             uint32_t crc32;
             uint32_t repeat;
-            uint32_t offset;
-            uint32_t length;
+            uint64_t offset;  // 64 bits: parts of merged romsets can go past 4 GB
+            uint64_t length;
             uint8_t *pattern;
             int _map_index;    // only used for "interleave maps" to "group patterns" conversion
             uint8_t *data;
@@ -36,7 +36,7 @@ typedef struct s_part {
 
 typedef struct s_patch
 {
-    uint32_t offset;
+    uint64_t offset;
     uint8_t *data;
     size_t data_length;
 } t_patch;
@@ -0,0 +1,876 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32) && !defined(_WIN64)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "globals.h"
+#include "interleave.h"
+#include "digest.h"
+#include "plan.h"
+#include "pool.h"
+#include "ring.h"
+
+/*
+    Plan construction
+*/
+
+static t_plan_op *add_op(t_plan *plan, int type, size_t length, size_t repeat) {
+    t_plan_op *op;
+
+    plan->ops = (t_plan_op *)realloc(plan->ops, sizeof(t_plan_op) * (plan->n_ops + 1));
+    op = plan->ops + plan->n_ops++;
+    memset(op, 0, sizeof(t_plan_op));
+    op->type = type;
+    op->offset = plan->size;
+    op->length = length;
+    op->repeat = repeat;
+    if (type != PLAN_PATCH) {
+        if (verbose) {
+            printf("writing %lu bytes @ %08lX\n", length * repeat, plan->size);
+        }
+        plan->size += length * repeat;
+    }
+    return op;
+}
+
+void plan_copy(t_plan *plan, const uint8_t *base, const uint8_t *src, int source, size_t length, size_t repeat) {
+    t_plan_op *op = add_op(plan, PLAN_COPY, length, repeat);
+
+    op->base = base;
+    op->src = src;
+    op->source = source;
+}
+
+// The arrays describing the group are copied, the data of its parts is not
+void plan_gather(t_plan *plan, int n_parts, uint8_t **srcs, int *sources, int **byte_offsets, int *n_src_bytes, size_t n_values, size_t repeat) {
+    int n_bytes_value = 0;
+    t_plan_op *op;
+
+    for (int i = 0; i < n_parts; i++) n_bytes_value += n_src_bytes[i];
+    op = add_op(plan, PLAN_GATHER, n_values * n_bytes_value, repeat);
+    op->n_parts = n_parts;
+    op->n_values = n_values;
+    op->srcs = (uint8_t **)malloc(sizeof(uint8_t *) * n_parts);
+    op->sources = (int *)malloc(sizeof(int) * n_parts);
+    op->byte_offsets = (int **)malloc(sizeof(int *) * n_parts);
+    op->n_src_bytes = (int *)malloc(sizeof(int) * n_parts);
+    for (int i = 0; i < n_parts; i++) {
+        op->srcs[i] = srcs[i];
+        op->sources[i] = sources[i];
+        op->n_src_bytes[i] = n_src_bytes[i];
+        op->byte_offsets[i] = (int *)malloc(sizeof(int) * n_src_bytes[i]);
+        memcpy(op->byte_offsets[i], byte_offsets[i], sizeof(int) * n_src_bytes[i]);
+    }
+}
+
+// Patches are added once all the parts are: patches past the end of the ROM are skipped, overlapping patches are reported
+void plan_patch(t_plan *plan, uint64_t offset, const uint8_t *data, size_t length) {
+    t_plan_op *op;
+
+    if (offset > plan->size || length > plan->size - offset) {
+        printf("warning: patch @ %08llX (%lu bytes) past the end of the ROM (%lu bytes). Skipping patch.\n",
+               (unsigned long long)offset, length, plan->size);
+        return;
+    }
+    for (int i = 0; i < plan->n_ops; i++) {
+        t_plan_op *other = plan->ops + i;
+        if (other->type == PLAN_PATCH && offset < other->offset + other->length && other->offset < offset + length) {
+            printf("warning: patch @ %08llX overlaps patch @ %08lX.\n", (unsigned long long)offset, other->offset);
+        }
+    }
+    op = add_op(plan, PLAN_PATCH, length, 1);
+    op->offset = offset;
+    op->src = data;
+    op->source = PLAN_NO_SOURCE;
+}
+
+void plan_output_free(t_plan_output *output) {
+    if (output->mapped) {
+#if !defined(_WIN32) && !defined(_WIN64)
+        munmap(output->data, output->size);
+#endif
+    } else {
+        free(output->data);
+    }
+    memset(output, 0, sizeof(t_plan_output));
+}
+
+void plan_free(t_plan *plan) {
+    for (int i = 0; i < plan->n_ops; i++) {
+        t_plan_op *op = plan->ops + i;
+        if (op->type == PLAN_GATHER) {
+            for (int j = 0; j < op->n_parts; j++) free(op->byte_offsets[j]);
+            free(op->byte_offsets);
+            free(op->n_src_bytes);
+            free(op->srcs);
+            free(op->sources);
+        }
+    }
+    free(plan->ops);
+    memset(plan, 0, sizeof(t_plan));
+}
+
+/*
+    Optimizer
+
+    Operations are merged with the one before them, when they write right after it:
+    - copies of contiguous data from the same buffer become a single copy
+    - copies of the same block become a single copy repeated
+    - repeated blocks of a single byte value become fills, and fills of the same value are merged
+*/
+
+static int is_fill(t_plan_op *op) {
+    for (size_t i = 1; i < op->length; i++) {
+        if (op->src[i] != op->src[0]) return 0;
+    }
+    return 1;
+}
+
+void plan_optimize(t_plan *plan) {
+    int i, n = 0;
+
+    for (i = 0; i < plan->n_ops; i++) {
+        t_plan_op *op = plan->ops + i;
+
+        // Sources loaded by plan_run() cannot be looked at yet
+        if (op->type == PLAN_COPY && op->repeat > 1 && (op->source == PLAN_NO_SOURCE || !plan->load) && is_fill(op)) {
+            op->type = PLAN_FILL;
+            op->value = op->src[0];
+            op->source = PLAN_NO_SOURCE;  // the source is not read anymore
+            op->length *= op->repeat;
+            op->repeat = 1;
+        }
+        if (n > 0) {
+            t_plan_op *last = plan->ops + n - 1;
+
+            if (last->type == PLAN_COPY && op->type == PLAN_COPY && last->repeat == 1 && op->repeat == 1 &&
+                last->base == op->base && last->src + last->length == op->src) {
+                last->length += op->length;
+                continue;
+            }
+            if (last->type == PLAN_COPY && op->type == PLAN_COPY && last->src == op->src && last->length == op->length) {
+                last->repeat += op->repeat;
+                continue;
+            }
+            if (last->type == PLAN_FILL && op->type == PLAN_FILL && last->value == op->value) {
+                last->length += op->length;
+                continue;
+            }
+        }
+        plan->ops[n++] = *op;
+    }
+    if (trace > 0) printf("plan: %d operations, %d after optimization\n", plan->n_ops, n);
+    plan->n_ops = n;
+}
+
+/*
+    Execution
+
+    The ROM file is sized and mapped to memory, or the ROM is assembled in a buffer of the size
+    of the ROM when the file can't be mapped. Operations write disjoint regions: they are run
+    in parallel on the thread pool, large groups split in ranges of values. Patches are applied
+    last, then the ROM is hashed (and written at once when it is not mapped).
+
+    In low memory mode (-L), operations are executed a chunk of STREAM_CHUNK_SIZE bytes at a
+    time instead, and chunks are patched, hashed and written as they come.
+*/
+
+#define STREAM_CHUNK_SIZE (64 * 1024)
+
+// Values of a group are interleaved in ranges of about this many output bytes, in parallel on the thread pool
+#define INTERLEAVE_CHUNK_SIZE (256 * 1024)
+
+/*
+    Loading and release of sources
+
+    plan_run() counts the operations reading each source and calls plan->release for a source once
+    the last of them is done: as soon as their jobs are done when the ROM is assembled in memory,
+    so that sources go while the ROM grows, and once the write thread is past their blocks in low
+    memory mode, as blocks may point into the source data.
+
+    With plan->load, sources are loaded in the order operations first read them, right before that.
+    When the ROM is assembled in memory, loads are jobs of the pool placed before the jobs of the first
+    operation reading their source, and they only start while sources loaded and not released yet take
+    less than LOAD_AHEAD bytes, or when all the jobs before them are done. In low memory mode, the
+    sources of an operation are loaded as it is reached.
+*/
+
+#define LOAD_AHEAD (64 * 1024 * 1024)
+
+typedef struct s_release {
+    t_plan *plan;
+    int n_sources;
+    int *uses;      // operations left reading each source, NULL if sources are not released
+    int *loaded;    // 1 once each source is loaded, -1 if it failed to. NULL if sources are not loaded.
+    size_t *sizes;  // memory taken by each loaded source
+    size_t in_memory;  // by the sources loaded and not released yet
+    int failed;
+    pthread_mutex_t lock;  // jobs finish on the threads of the pool: one release at a time
+    pthread_cond_t changed;  // a source was loaded or released, or a job is done
+} t_release;
+
+// Sources read by an operation
+static int *op_sources(t_plan_op *op, int *n) {
+    *n = op->type == PLAN_COPY ? 1 : op->type == PLAN_GATHER ? op->n_parts : 0;
+    return op->type == PLAN_COPY ? &op->source : op->sources;
+}
+
+static void release_init(t_release *release, t_plan *plan) {
+    int i, j, n, *sources;
+
+    memset(release, 0, sizeof(t_release));
+    release->plan = plan;
+    pthread_mutex_init(&release->lock, NULL);
+    pthread_cond_init(&release->changed, NULL);
+    for (i = 0; i < plan->n_ops; i++) {
+        sources = op_sources(plan->ops + i, &n);
+        for (j = 0; j < n; j++) {
+            if (sources[j] >= release->n_sources) release->n_sources = sources[j] + 1;
+        }
+    }
+    if (plan->load) {
+        release->loaded = (int *)calloc(release->n_sources + 1, sizeof(int));
+        release->sizes = (size_t *)calloc(release->n_sources + 1, sizeof(size_t));
+    }
+    if (!plan->release) return;
+    release->uses = (int *)calloc(release->n_sources + 1, sizeof(int));
+    for (i = 0; i < plan->n_ops; i++) {
+        sources = op_sources(plan->ops + i, &n);
+        for (j = 0; j < n; j++) {
+            if (sources[j] >= 0) release->uses[sources[j]]++;
+        }
+    }
+}
+
+static void release_free(t_release *release) {
+    free(release->uses);
+    free(release->loaded);
+    free(release->sizes);
+    pthread_mutex_destroy(&release->lock);
+    pthread_cond_destroy(&release->changed);
+}
+
+static void release_source(t_release *release, int source) {
+    if (source < 0 || !release->uses) return;
+    pthread_mutex_lock(&release->lock);
+    if (!--release->uses[source]) {
+        if (trace > 0) printf("plan: releasing source %d\n", source);
+        release->plan->release(release->plan->ctx, source);
+        if (release->sizes) {
+            release->in_memory -= release->sizes[source];
+            release->sizes[source] = 0;
+            pthread_cond_broadcast(&release->changed);
+        }
+    }
+    pthread_mutex_unlock(&release->lock);
+}
+
+// The operation is done with its sources
+static void release_op(t_release *release, t_plan_op *op) {
+    int j, n, *sources = op_sources(op, &n);
+
+    for (j = 0; j < n; j++) release_source(release, sources[j]);
+}
+
+// The memory of a source is counted from the start of its load, so that loads running at the same time add up
+static void load_source(t_release *release, int source) {
+    t_plan *plan = release->plan;
+    size_t size = plan->source_size(plan->ctx, source);
+    int res;
+
+    pthread_mutex_lock(&release->lock);
+    release->sizes[source] = size;
+    release->in_memory += size;
+    pthread_mutex_unlock(&release->lock);
+
+    if (trace > 0) printf("plan: loading source %d (%lu bytes)\n", source, (unsigned long)size);
+    res = plan->load(plan->ctx, source);
+
+    pthread_mutex_lock(&release->lock);
+    if (res) {
+        release->loaded[source] = -1;
+        release->failed = 1;
+        release->in_memory -= size;
+        release->sizes[source] = 0;
+    } else {
+        release->loaded[source] = 1;
+    }
+    pthread_cond_broadcast(&release->changed);
+    pthread_mutex_unlock(&release->lock);
+}
+
+// Wait for the sources of an operation to be loaded. Returns -1 if one of them could not be, the operation is skipped.
+static int wait_sources(t_release *release, t_plan_op *op) {
+    int j, n, *sources = op_sources(op, &n), res = 0;
+
+    if (!release->loaded) return 0;
+    pthread_mutex_lock(&release->lock);
+    for (j = 0; j < n; j++) {
+        if (sources[j] < 0) continue;
+        while (!release->loaded[sources[j]]) pthread_cond_wait(&release->changed, &release->lock);
+        if (release->loaded[sources[j]] < 0) res = -1;
+    }
+    pthread_mutex_unlock(&release->lock);
+    return res;
+}
+
+// Load the sources of an operation that are not loaded yet, on the calling thread
+static int load_sources(t_release *release, t_plan_op *op) {
+    int j, n, *sources = op_sources(op, &n);
+
+    if (!release->loaded) return 0;
+    for (j = 0; j < n; j++) {
+        if (sources[j] >= 0 && !release->loaded[sources[j]]) load_source(release, sources[j]);
+    }
+    return wait_sources(release, op);
+}
+
+typedef struct s_run_job {
+    t_plan_op *op;       // NULL when the job loads a source
+    int source;          // source loaded by the job
+    size_t first, last;  // range of values of a group
+    size_t size;         // bytes written by the job
+} t_run_job;
+
+typedef struct s_run {
+    uint8_t *data;
+    t_run_job *jobs;
+    int n_jobs;
+    t_plan_op *ops;
+    int *pending;  // jobs left for each operation
+    t_release *release;
+    uint8_t *done;     // jobs done, NULL if sources are not loaded
+    int first_pending; // jobs before it are all done
+} t_run;
+
+// The first length bytes at dest are repeated n_writes times in total: every copy doubles
+// the size of the block, so large fills take a few big memcpy() instead of one per repetition.
+static void repeat_block(uint8_t *dest, size_t length, size_t n_writes) {
+    size_t total = length * n_writes;
+    size_t done = length;
+
+    while (done < total) {
+        size_t n = done < total - done ? done : total - done;
+        memcpy(dest + done, dest, n);
+        done += n;
+    }
+}
+
+static void run_op(t_plan_op *op, uint8_t *dest) {
+    if (op->length == 0) return;
+    switch (op->type) {
+        case PLAN_COPY:
+        case PLAN_PATCH:
+            memcpy(dest, op->src, op->length);
+            break;
+        case PLAN_FILL:
+            memset(dest, op->value, op->length);
+            break;
+    }
+    repeat_block(dest, op->length, op->repeat);
+}
+
+// Loads only start ahead of the jobs before them while there is room for them
+static void run_load(t_run *run, int i) {
+    t_release *release = run->release;
+
+    pthread_mutex_lock(&release->lock);
+    while (release->in_memory >= LOAD_AHEAD && run->first_pending < i) {
+        pthread_cond_wait(&release->changed, &release->lock);
+    }
+    pthread_mutex_unlock(&release->lock);
+    load_source(release, run->jobs[i].source);
+}
+
+static void run_done(t_run *run, int i) {
+    t_release *release = run->release;
+
+    pthread_mutex_lock(&release->lock);
+    run->done[i] = 1;
+    while (run->first_pending < run->n_jobs && run->done[run->first_pending]) run->first_pending++;
+    pthread_cond_broadcast(&release->changed);
+    pthread_mutex_unlock(&release->lock);
+}
+
+static void run_job(void *ctx, int i) {
+    t_run *run = (t_run *)ctx;
+    t_run_job *job = run->jobs + i;
+    t_plan_op *op = job->op;
+
+    if (!op) {
+        run_load(run, i);
+    } else {
+        if (wait_sources(run->release, op) == 0) {
+            if (op->type == PLAN_GATHER) {
+                interleave(run->data + op->offset, op->srcs, op->n_parts, op->byte_offsets, op->n_src_bytes, job->first, job->last);
+            } else {
+                run_op(op, run->data + op->offset);
+            }
+        }
+        if (!__atomic_sub_fetch(run->pending + (op - run->ops), 1, __ATOMIC_ACQ_REL)) {
+            release_op(run->release, op);
+        }
+    }
+    if (run->done) run_done(run, i);
+}
+
+static int cmp_run_job(const void *p1, const void *p2) {
+    const t_run_job *j1 = (const t_run_job *)p1;
+    const t_run_job *j2 = (const t_run_job *)p2;
+
+    if (j1->size != j2->size) return j1->size < j2->size ? 1 : -1;  // largest first
+    return j1->op < j2->op ? -1 : j1->op > j2->op;
+}
+
+static void add_job(t_run *run, t_run_job job) {
+    run->jobs = (t_run_job *)realloc(run->jobs, sizeof(t_run_job) * (run->n_jobs + 1));
+    run->jobs[run->n_jobs++] = job;
+}
+
+static void run_parallel(t_plan *plan, uint8_t *data, t_release *release) {
+    t_run run = {0};
+    uint8_t *scheduled = release->loaded ? (uint8_t *)calloc(release->n_sources + 1, 1) : NULL;
+    int i, j, n, *sources;
+
+    run.data = data;
+    run.ops = plan->ops;
+    run.release = release;
+    run.pending = (int *)calloc(plan->n_ops + 1, sizeof(int));
+    for (i = 0; i < plan->n_ops; i++) {
+        t_plan_op *op = plan->ops + i;
+
+        if (op->type == PLAN_PATCH || op->length == 0) continue;
+        // Sources are loaded right before the jobs of the first operation reading them
+        sources = op_sources(op, &n);
+        for (j = 0; scheduled && j < n; j++) {
+            if (sources[j] >= 0 && !scheduled[sources[j]]) {
+                scheduled[sources[j]] = 1;
+                add_job(&run, (t_run_job){NULL, sources[j], 0, 0, 0});
+            }
+        }
+        if (op->type == PLAN_GATHER) {
+            // Each value only depends on its index: ranges of values are filled independently.
+            // Ranges are a multiple of 32 values, to keep whole blocks for the vector kernels.
+            size_t n_bytes_value = op->length / op->n_values;
+            size_t chunk_values = ((INTERLEAVE_CHUNK_SIZE / n_bytes_value) + 31) & ~(size_t)31;
+
+            for (size_t first = 0; first < op->n_values; first += chunk_values) {
+                size_t last = op->n_values - first < chunk_values ? op->n_values : first + chunk_values;
+                add_job(&run, (t_run_job){op, PLAN_NO_SOURCE, first, last, (last - first) * n_bytes_value});
+                run.pending[i]++;
+            }
+        } else {
+            add_job(&run, (t_run_job){op, PLAN_NO_SOURCE, 0, 0, op->length * op->repeat});
+            run.pending[i]++;
+        }
+    }
+    // Nothing to sort or run when the ROM only has patches, or nothing at all. Jobs loading sources
+    // stay in plan order, otherwise largest jobs first so that the longest does not start last.
+    if (run.n_jobs) {
+        if (scheduled) run.done = (uint8_t *)calloc(run.n_jobs, 1);
+        else qsort(run.jobs, run.n_jobs, sizeof(t_run_job), cmp_run_job);
+        pool_run(run.n_jobs, run_job, &run);
+    }
+    free(run.jobs);
+    free(run.pending);
+    free(run.done);
+    free(scheduled);
+
+    // Repeated groups are complete once all their ranges are
+    for (i = 0; i < plan->n_ops; i++) {
+        t_plan_op *op = plan->ops + i;
+        if (op->type == PLAN_GATHER) repeat_block(data + op->offset, op->length, op->repeat);
+    }
+    // Patches come last in the plan
+    for (i = 0; i < plan->n_ops; i++) {
+        if (plan->ops[i].type == PLAN_PATCH) run_op(plan->ops + i, data + plan->ops[i].offset);
+    }
+}
+
+// Size the ROM file and map it to memory. NULL if it can't be done, then the ROM is written with fwrite().
+static uint8_t *map_output(FILE *out, size_t size) {
+#if defined(_WIN32) || defined(_WIN64)
+    return NULL;
+#else
+    void *data;
+
+    if (size == 0) return NULL;
+#if defined(__linux__)
+    // Allocate the blocks now: running out of disk space while writing to the mapping would crash
+    if (posix_fallocate(fileno(out), 0, size)) return NULL;
+#else
+    if (ftruncate(fileno(out), size)) return NULL;
+#endif
+    data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(out), 0);
+    return data == MAP_FAILED ? NULL : (uint8_t *)data;
+#endif
+}
+
+/*
+    Low memory mode pipeline
+
+    A load thread uncompresses entries ahead of the calling thread, which assembles the ROM in blocks,
+    pushed to a hash thread that runs digest_update() in order and passes them to a write thread.
+    Blocks either point to entry data, that stays put until the write thread is past it, or to one
+    of STREAM_BUFFERS chunks, given back once written. With a single thread (-j 1), entries are
+    uncompressed as they are reached and blocks are hashed and written as they are pushed.
+*/
+
+#define STREAM_BUFFERS 8
+#define STREAM_QUEUE 16  // blocks in flight between two stages
+
+typedef struct s_block {
+    const uint8_t *data;
+    size_t length;    // 0 ends the stream
+    uint8_t *buffer;  // buffer to give back once written, NULL when data is entry data
+} t_block;
+
+typedef struct s_stream {
+    FILE *out;
+    t_digest *digest;    // NULL if the ROM is not hashed
+    size_t length;       // bytes pushed so far
+    uint8_t *chunk;      // repeated blocks of the operation being assembled
+    uint8_t *buffers;
+    t_plan_op *patches;  // patches come last in the plan
+    int n_patches;
+    int pipelined;
+    pthread_t hasher;
+    pthread_t writer;
+    t_ring to_hash;
+    t_ring to_write;
+    t_ring free_buffers;
+    size_t written;       // bytes written so far, updated by the write thread
+    t_release *release;
+    t_plan_op *ops;       // operations streamed so far, in order
+    size_t *ends;         // length of the stream after each of them
+    int n_ended;
+    int n_released;
+    int loading;          // the load thread runs
+    pthread_t loader;
+    int *loads;           // sources in the order operations first read them
+    int n_loads;
+    int *load_index;      // index of each source in loads
+    int needed;           // loads up to this one are waited for, they do not wait for room
+} t_stream;
+
+static void write_block(t_stream *stream, t_block *block) {
+    fwrite(block->data, 1, block->length, stream->out);
+    __atomic_add_fetch(&stream->written, block->length, __ATOMIC_RELEASE);
+    if (block->buffer) {
+        ring_push(&stream->free_buffers, &block->buffer);
+    }
+}
+
+static void *hash_thread(void *arg) {
+    t_stream *stream = (t_stream *)arg;
+    t_block block;
+
+    do {
+        ring_pop(&stream->to_hash, &block);
+        if (stream->digest) digest_update(stream->digest, block.data, block.length);
+        ring_push(&stream->to_write, &block);
+    } while (block.length);
+    return NULL;
+}
+
+static void *write_thread(void *arg) {
+    t_stream *stream = (t_stream *)arg;
+    t_block block;
+
+    for (;;) {
+        ring_pop(&stream->to_write, &block);
+        if (!block.length) break;
+        write_block(stream, &block);
+    }
+    return NULL;
+}
+
+static void stream_push(t_stream *stream, const uint8_t *data, size_t length, uint8_t *buffer) {
+    t_block block = {data, length, buffer};
+
+    stream->length += length;
+    if (stream->pipelined) {
+        ring_push(&stream->to_hash, &block);
+    } else {
+        if (stream->digest) digest_update(stream->digest, data, length);
+        write_block(stream, &block);
+    }
+}
+
+// A free buffer, waits for one to be written if none is
+static uint8_t *stream_buffer(t_stream *stream) {
+    uint8_t *buffer;
+
+    ring_pop(&stream->free_buffers, &buffer);
+    return buffer;
+}
+
+static int is_patched(t_stream *stream, size_t length) {
+    for (int i = 0; i < stream->n_patches; i++) {
+        t_plan_op *patch = stream->patches + i;
+        if (patch->offset < stream->length + length && stream->length < patch->offset + patch->length) return 1;
+    }
+    return 0;
+}
+
+// Apply the patches to the next length bytes of the ROM, in buffer
+static void patch_buffer(t_stream *stream, uint8_t *buffer, size_t length) {
+    for (int i = 0; i < stream->n_patches; i++) {
+        t_plan_op *patch = stream->patches + i;
+        size_t start = patch->offset > stream->length ? patch->offset : stream->length;
+        size_t end = patch->offset + patch->length < stream->length + length ? patch->offset + patch->length : stream->length + length;
+
+        if (start < end) {
+            memcpy(buffer + (start - stream->length), patch->src + (start - patch->offset), end - start);
+        }
+    }
+}
+
+// Patch, hash and write length bytes of buffer at the end of the ROM
+static void stream_write_buffer(t_stream *stream, uint8_t *buffer, size_t length) {
+    patch_buffer(stream, buffer, length);
+    stream_push(stream, buffer, length, buffer);
+}
+
+// Same for data that is not a buffer. Entry data is not modified and is passed as is when not patched,
+// anything else is copied to buffers.
+static void stream_write(t_stream *stream, const uint8_t *data, size_t length) {
+    while (length) {
+        size_t n = length < STREAM_CHUNK_SIZE ? length : STREAM_CHUNK_SIZE;
+
+        if (data == stream->chunk || is_patched(stream, n)) {
+            uint8_t *buffer = stream_buffer(stream);
+            memcpy(buffer, data, n);
+            stream_write_buffer(stream, buffer, n);
+        } else {
+            stream_push(stream, data, n, NULL);
+        }
+        data += n;
+        length -= n;
+    }
+}
+
+static void stream_start(t_stream *stream) {
+    pthread_t writer, hasher;
+
+    stream->chunk = (uint8_t *)malloc(STREAM_CHUNK_SIZE);
+    stream->buffers = (uint8_t *)malloc(STREAM_BUFFERS * STREAM_CHUNK_SIZE);
+    ring_init(&stream->to_hash, STREAM_QUEUE, sizeof(t_block));
+    ring_init(&stream->to_write, STREAM_QUEUE, sizeof(t_block));
+    ring_init(&stream->free_buffers, STREAM_BUFFERS, sizeof(uint8_t *));
+    for (int i = 0; i < STREAM_BUFFERS; i++) {
+        uint8_t *buffer = stream->buffers + i * STREAM_CHUNK_SIZE;
+        ring_push(&stream->free_buffers, &buffer);
+    }
+
+    if (threads <= 1 || pthread_create(&writer, NULL, write_thread, stream)) return;
+    if (pthread_create(&hasher, NULL, hash_thread, stream)) {
+        t_block end = {NULL, 0, NULL};
+        ring_push(&stream->to_write, &end);
+        pthread_join(writer, NULL);
+        return;
+    }
+    stream->writer = writer;
+    stream->hasher = hasher;
+    stream->pipelined = 1;
+}
+
+static void stream_end(t_stream *stream) {
+    if (stream->pipelined) {
+        t_block end = {NULL, 0, NULL};
+        ring_push(&stream->to_hash, &end);
+        pthread_join(stream->hasher, NULL);
+        pthread_join(stream->writer, NULL);
+    }
+    ring_free(&stream->to_hash);
+    ring_free(&stream->to_write);
+    ring_free(&stream->free_buffers);
+    free(stream->buffers);
+    free(stream->chunk);
+}
+
+/*
+    With plan->load, a load thread loads sources in the order operations first read them, while
+    sources loaded and not released yet take less than STREAM_LOAD_AHEAD bytes: the next entries are
+    uncompressed while the current ones are assembled, hashed and written. The calling thread waits
+    for the sources of an operation when it reaches it. With a single thread, it loads them itself.
+*/
+
+#define STREAM_LOAD_AHEAD (16 * 1024 * 1024)
+
+static void *load_thread(void *arg) {
+    t_stream *stream = (t_stream *)arg;
+    t_release *release = stream->release;
+
+    for (int k = 0; k < stream->n_loads; k++) {
+        pthread_mutex_lock(&release->lock);
+        while (release->in_memory >= STREAM_LOAD_AHEAD && k > stream->needed) {
+            pthread_cond_wait(&release->changed, &release->lock);
+        }
+        pthread_mutex_unlock(&release->lock);
+        load_source(release, stream->loads[k]);
+    }
+    return NULL;
+}
+
+static void stream_start_loads(t_stream *stream, int n_ops) {
+    t_release *release = stream->release;
+    int i, j, n, *sources;
+
+    if (!release->loaded || threads <= 1) return;
+    stream->loads = (int *)malloc(sizeof(int) * (release->n_sources + 1));
+    stream->load_index = (int *)malloc(sizeof(int) * (release->n_sources + 1));
+    memset(stream->load_index, -1, sizeof(int) * (release->n_sources + 1));
+    for (i = 0; i < n_ops; i++) {
+        sources = op_sources(stream->ops + i, &n);
+        for (j = 0; j < n; j++) {
+            if (sources[j] >= 0 && stream->load_index[sources[j]] < 0) {
+                stream->load_index[sources[j]] = stream->n_loads;
+                stream->loads[stream->n_loads++] = sources[j];
+            }
+        }
+    }
+    stream->loading = !pthread_create(&stream->loader, NULL, load_thread, stream);
+}
+
+static void stream_end_loads(t_stream *stream) {
+    if (stream->loading) pthread_join(stream->loader, NULL);
+    free(stream->loads);
+    free(stream->load_index);
+}
+
+// Wait for the sources of an operation. Returns -1 if one of them could not be loaded, the operation is skipped.
+static int stream_sources(t_stream *stream, t_plan_op *op) {
+    t_release *release = stream->release;
+    int j, n, *sources = op_sources(op, &n);
+
+    if (!stream->loading) return load_sources(release, op);
+    pthread_mutex_lock(&release->lock);
+    for (j = 0; j < n; j++) {
+        if (sources[j] >= 0 && stream->load_index[sources[j]] > stream->needed) {
+            stream->needed = stream->load_index[sources[j]];
+            pthread_cond_broadcast(&release->changed);
+        }
+    }
+    pthread_mutex_unlock(&release->lock);
+    return wait_sources(release, op);
+}
+
+// Release the sources of the operations the write thread is done with, or of all of them
+static void stream_release(t_stream *stream, int all) {
+    size_t written = __atomic_load_n(&stream->written, __ATOMIC_ACQUIRE);
+
+    while (stream->n_released < stream->n_ended && (all || stream->ends[stream->n_released] <= written)) {
+        release_op(stream->release, stream->ops + stream->n_released++);
+    }
+}
+
+static void stream_op(t_stream *stream, t_plan_op *op) {
+    size_t left, n;
+
+    if (op->length == 0) return;
+    switch (op->type) {
+        case PLAN_COPY:
+            if (op->repeat > 1 && op->length < STREAM_CHUNK_SIZE) {
+                // Small repeated blocks are repeated in a chunk first, written as many times as needed
+                size_t copies = STREAM_CHUNK_SIZE / op->length < op->repeat ? STREAM_CHUNK_SIZE / op->length : op->repeat;
+                memcpy(stream->chunk, op->src, op->length);
+                repeat_block(stream->chunk, op->length, copies);
+                for (left = op->repeat; left; left -= n) {
+                    n = copies < left ? copies : left;
+                    stream_write(stream, stream->chunk, op->length * n);
+                }
+            } else {
+                for (left = op->repeat; left; left--) stream_write(stream, op->src, op->length);
+            }
+            break;
+        case PLAN_FILL:
+            memset(stream->chunk, op->value, op->length < STREAM_CHUNK_SIZE ? op->length : STREAM_CHUNK_SIZE);
+            for (left = op->length; left; left -= n) {
+                n = left < STREAM_CHUNK_SIZE ? left : STREAM_CHUNK_SIZE;
+                stream_write(stream, stream->chunk, n);
+            }
+            break;
+        case PLAN_GATHER: {
+            // Interleave a chunk worth of values at a time, repeats are interleaved again
+            size_t n_bytes_value = op->length / op->n_values;
+            size_t chunk_values = STREAM_CHUNK_SIZE / n_bytes_value;
+            uint8_t **srcs = (uint8_t **)calloc(op->n_parts, sizeof(uint8_t *));
+
+            for (size_t r = 0; r < op->repeat; r++) {
+                for (size_t first = 0; first < op->n_values; first += n) {
+                    n = op->n_values - first < chunk_values ? op->n_values - first : chunk_values;
+                    for (int i = 0; i < op->n_parts; i++) srcs[i] = op->srcs[i] + first * op->n_src_bytes[i];
+                    uint8_t *buffer = stream_buffer(stream);
+                    interleave(buffer, srcs, op->n_parts, op->byte_offsets, op->n_src_bytes, 0, n);
+                    stream_write_buffer(stream, buffer, n * n_bytes_value);
+                }
+            }
+            free(srcs);
+            break;
+        }
+    }
+}
+
+// Execute the plan to out, digest (initialized with digest_init()) gets the digests of what is written.
+// With a NULL digest, the ROM is not hashed. Sources are loaded and released along the way. Returns 0 if all
+// sources could be loaded and all was written.
+int plan_run(t_plan *plan, FILE *out, t_digest *digest) {
+    t_release release;
+    int i, res = 0;
+
+    release_init(&release, plan);
+    if (plan->output) memset(plan->output, 0, sizeof(t_plan_output));
+    if (low_memory) {
+        t_stream stream = {0};
+
+        stream.out = out;
+        stream.digest = digest;
+        for (i = plan->n_ops; i > 0 && plan->ops[i - 1].type == PLAN_PATCH; i--);
+        stream.patches = plan->ops + i;
+        stream.n_patches = plan->n_ops - i;
+        stream.release = &release;
+        stream.ops = plan->ops;
+        stream.ends = (size_t *)malloc(sizeof(size_t) * (plan->n_ops + 1));
+        stream_start(&stream);
+        stream_start_loads(&stream, plan->n_ops - stream.n_patches);
+        for (i = 0; i < plan->n_ops - stream.n_patches; i++) {
+            if (stream_sources(&stream, plan->ops + i) == 0) stream_op(&stream, plan->ops + i);
+            stream.ends[stream.n_ended++] = stream.length;
+            stream_release(&stream, 0);
+        }
+        stream_end_loads(&stream);
+        stream_end(&stream);
+        stream_release(&stream, 1);
+        free(stream.ends);
+    } else {
+        uint8_t *map = map_output(out, plan->size);
+        uint8_t *data = map ? map : (uint8_t *)malloc(plan->size ? plan->size : 1);
+
+        if (trace > 0) printf("plan: %s output\n", map ? "mapped" : "buffered");
+        if (!data) {
+            printf("error: couldn't allocate %lu bytes for the ROM\n", plan->size);
+            res = -1;
+        } else {
+            run_parallel(plan, data, &release);
+            if (digest) digest_update(digest, data, plan->size);
+            if (!map) fwrite(data, 1, plan->size, out);
+            if (plan->output) {
+                *plan->output = (t_plan_output){data, plan->size, map != NULL};
+            } else {
+                t_plan_output output = {data, plan->size, map != NULL};
+                plan_output_free(&output);
+            }
+        }
+    }
+    if (digest) digest_final(digest);
+    if (release.failed) res = -1;
+    release_free(&release);
+
+    return res ? res : ferror(out);
+}
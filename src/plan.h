@@ -0,0 +1,79 @@
+#ifndef _PLAN_H_
+#define _PLAN_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "digest.h"
+
+/*
+    A ROM build plan: a flat list of operations, each writing a block at a known offset of the ROM.
+    rom.c compiles the parts of a ROM to a plan once the buffers of their data are known, plan_optimize()
+    merges operations and plan_run() executes them. Data read by operations can be tagged with the index
+    of its source (a zip entry), filled in through plan->load right before the first operation reading it
+    runs, and handed back through plan->release as soon as it has been written.
+*/
+#define PLAN_COPY 0    // copy length bytes from src
+#define PLAN_FILL 1    // length bytes set to value
+#define PLAN_GATHER 2  // interleave n_values values from the parts of a group
+#define PLAN_PATCH 3   // copy length bytes from src over what the other operations wrote
+
+typedef struct s_plan_op {
+    int type;
+    size_t offset;        // where the operation writes in the ROM
+    size_t length;        // bytes written by one repetition
+    size_t repeat;        // number of repetitions, written one after the other
+    const uint8_t *base;  // buffer src points into, copies are only merged within a buffer
+    const uint8_t *src;
+    int source;           // entry src comes from, PLAN_NO_SOURCE if it is not to be released
+    uint8_t value;
+    int n_parts;          // PLAN_GATHER only
+    uint8_t **srcs;
+    int *sources;         // entry of each part, as source
+    int **byte_offsets;
+    int *n_src_bytes;
+    size_t n_values;
+} t_plan_op;
+
+#define PLAN_NO_SOURCE -1
+
+// Called by plan_run() before the first operation reading a source runs, to fill in the data the
+// operations point to. Can be called from the threads of the pool, several sources at a time.
+// Returns 0 once the source is loaded, -1 if it could not be: the operations reading it are
+// skipped and plan_run() fails.
+typedef int (*t_plan_load)(void *ctx, int source);
+
+// Memory a source takes once loaded, until it is released
+typedef size_t (*t_plan_size)(void *ctx, int source);
+
+// Called by plan_run() for a source once the last operation reading it is written.
+// Can be called from the threads of the pool, one call at a time.
+typedef void (*t_plan_release)(void *ctx, int source);
+
+// The ROM as built by plan_run(), kept for hashing after the ROM file is closed
+typedef struct s_plan_output {
+    uint8_t *data;  // NULL if the ROM was streamed (low memory mode) or could not be built
+    size_t size;
+    int mapped;     // data maps the ROM file, otherwise it was malloc'd
+} t_plan_output;
+
+typedef struct s_plan {
+    t_plan_op *ops;
+    int n_ops;
+    size_t size;  // size of the ROM
+    t_plan_load load;        // NULL if sources are loaded before plan_run()
+    t_plan_size source_size; // set along with load
+    t_plan_release release;  // NULL if sources are not released
+    void *ctx;               // passed to load and release
+    t_plan_output *output;   // if not NULL, plan_run() hands the ROM over there instead of dropping it
+} t_plan;
+
+void plan_copy(t_plan *plan, const uint8_t *base, const uint8_t *src, int source, size_t length, size_t repeat);
+void plan_gather(t_plan *plan, int n_parts, uint8_t **srcs, int *sources, int **byte_offsets, int *n_src_bytes, size_t n_values, size_t repeat);
+void plan_patch(t_plan *plan, uint64_t offset, const uint8_t *data, size_t length);
+void plan_optimize(t_plan *plan);
+int plan_run(t_plan *plan, FILE *out, t_digest *digest);
+void plan_free(t_plan *plan);
+void plan_output_free(t_plan_output *output);
+
+#endif
@@ -0,0 +1,65 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "globals.h"
+#include "pool.h"
+
+typedef struct s_pool {
+    t_pool_job job;
+    void *ctx;
+    int n_jobs;
+    int next_job;
+} t_pool;
+
+static void *pool_worker(void *arg) {
+    t_pool *pool = (t_pool *)arg;
+    int i;
+
+    while ((i = __atomic_fetch_add(&pool->next_job, 1, __ATOMIC_RELAXED)) < pool->n_jobs) {
+        pool->job(pool->ctx, i);
+    }
+    return NULL;
+}
+
+void pool_run(int n_jobs, t_pool_job job, void *ctx) {
+    t_pool pool = {job, ctx, n_jobs, 0};
+    int n_workers = threads < n_jobs ? threads : n_jobs;
+    pthread_t *workers;
+    int i;
+
+    if (n_workers <= 1) {
+        pool_worker(&pool);
+        return;
+    }
+
+    // The calling thread is one of the workers
+    workers = (pthread_t *)calloc(n_workers - 1, sizeof(pthread_t));
+    for (i = 0; i < n_workers - 1; i++) {
+        if (pthread_create(workers + i, NULL, pool_worker, &pool)) {
+            break;
+        }
+    }
+    pool_worker(&pool);
+    while (i--) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+}
+
+int get_cpu_count() {
+#if defined(_WIN32) || defined(_WIN64)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+#endif
+}
@@ -0,0 +1,12 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+typedef void (*t_pool_job)(void *ctx, int job);
+
+// Call job(ctx, i) for i in [0, n_jobs) on up to "threads" worker threads and
+// wait for all jobs to complete. Jobs are started in increasing order.
+void pool_run(int n_jobs, t_pool_job job, void *ctx);
+
+int get_cpu_count();
+
+#endif
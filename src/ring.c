@@ -0,0 +1,49 @@
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+
+#define RING_SPINS 64  // polls before yielding the CPU
+
+void ring_init(t_ring *ring, uint32_t capacity, size_t item_size) {
+    memset(ring, 0, sizeof(t_ring));
+    for (ring->capacity = 1; ring->capacity < capacity; ring->capacity <<= 1);
+    ring->item_size = item_size;
+    ring->items = (uint8_t *)malloc(ring->capacity * item_size);
+}
+
+static void ring_wait(int *spins) {
+    if (++(*spins) > RING_SPINS) {
+        sched_yield();
+    }
+}
+
+// Waits while the ring is full
+void ring_push(t_ring *ring, const void *item) {
+    uint32_t tail = ring->tail;
+    int spins = 0;
+
+    while (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->capacity) {
+        ring_wait(&spins);
+    }
+    memcpy(ring->items + (tail & (ring->capacity - 1)) * ring->item_size, item, ring->item_size);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Waits while the ring is empty
+void ring_pop(t_ring *ring, void *item) {
+    uint32_t head = ring->head;
+    int spins = 0;
+
+    while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head) {
+        ring_wait(&spins);
+    }
+    memcpy(item, ring->items + (head & (ring->capacity - 1)) * ring->item_size, ring->item_size);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void ring_free(t_ring *ring) {
+    free(ring->items);
+    ring->items = NULL;
+}
@@ -0,0 +1,22 @@
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Bounded ring of fixed size items between exactly one producer thread and one consumer thread.
+// No locks: head and tail are each written by one side only. Waiting sides spin, then yield.
+typedef struct s_ring {
+    uint8_t *items;
+    size_t item_size;
+    uint32_t capacity;  // power of 2
+    uint32_t head __attribute__((aligned(64)));  // next item to pop, written by the consumer
+    uint32_t tail __attribute__((aligned(64)));  // next item to push, written by the producer
+} t_ring;
+
+void ring_init(t_ring *ring, uint32_t capacity, size_t item_size);
+void ring_push(t_ring *ring, const void *item);
+void ring_pop(t_ring *ring, void *item);
+void ring_free(t_ring *ring);
+
+#endif
@@ -2,85 +2,153 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "cache.h"
+#include "digest.h"
+#include "diskcache.h"
 #include "globals.h"
-#include "md5.h"
+#include "md5batch.h"
+#include "plan.h"
 #include "rom.h"
 #include "unzip.h"
 #include "utils.h"
+#include "zipindex.h"
 
 static t_file *files = NULL;
 static int n_files = 0;
+static t_zip *zips = NULL;
+static int n_zips = 0;
 
-int get_file_by_crc(t_file *files, int n_files, uint32_t crc) {
+/*
+    Zip entries are looked up through two open addressing hash tables, one keyed by crc and one by name.
+    Slots hold indexes in files (-1 when empty) and are probed linearly. When several entries share a key,
+    only the first one is indexed, so lookups return the same entry as a linear scan of files would.
+*/
+static int *crc_index = NULL;
+static int *name_index = NULL;
+static uint32_t index_mask = 0;
+
+static uint32_t hash_name(const char *name) {
+    uint32_t hash = 2166136261u;  // FNV-1a
+
+    for (int i = 0; name[i] && i < 1024; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static void index_files() {
+    uint32_t size = 16;
     int i;
 
+    while (size < 2 * (uint32_t)n_files) size <<= 1;
+    index_mask = size - 1;
+    crc_index = (int *)realloc(crc_index, sizeof(int) * size);
+    name_index = (int *)realloc(name_index, sizeof(int) * size);
+    memset(crc_index, -1, sizeof(int) * size);
+    memset(name_index, -1, sizeof(int) * size);
+
+    for (i = 0; i < n_files; i++) {
+        uint32_t h;
+
+        for (h = files[i].crc32 & index_mask; crc_index[h] != -1; h = (h + 1) & index_mask) {
+            if (files[crc_index[h]].crc32 == files[i].crc32) break;
+        }
+        if (crc_index[h] == -1) crc_index[h] = i;
+
+        for (h = hash_name(files[i].name) & index_mask; name_index[h] != -1; h = (h + 1) & index_mask) {
+            if (strncmp(files[name_index[h]].name, files[i].name, 1024) == 0) break;
+        }
+        if (name_index[h] == -1) name_index[h] = i;
+    }
+}
+
+int get_file_by_crc(uint32_t crc) {
+    uint32_t h;
+
     if (trace > 0) {
         printf("looking for crc: %08x\n", crc);
     }
 
-    for (i = 0; i < n_files; i++) {
-        if (files[i].crc32 == crc) {
+    if (!crc_index) return -1;
+    for (h = crc & index_mask; crc_index[h] != -1; h = (h + 1) & index_mask) {
+        if (files[crc_index[h]].crc32 == crc) {
             if (trace > 0) {
-                printf("crc matches for file: %s\n", files[i].name);
+                printf("crc matches for file: %s\n", files[crc_index[h]].name);
             }
-            return i;
+            return crc_index[h];
         }
     }
     return -1;
 }
 
-int get_file_by_name(t_file *files, int n_files, char *name) {
-    int i;
+int get_file_by_name(char *name) {
+    uint32_t h;
 
-    for (i = 0; i < n_files; i++) {
-        if (strncmp(files[i].name, name, 1024) == 0) {
+    if (!name_index) return -1;
+    for (h = hash_name(name) & index_mask; name_index[h] != -1; h = (h + 1) & index_mask) {
+        if (strncmp(files[name_index[h]].name, name, 1024) == 0) {
             if (trace > 0) {
-                printf("name matches for file: %s\n", files[i].name);
+                printf("name matches for file: %s\n", files[name_index[h]].name);
             }
-            return i;
+            return name_index[h];
         }
     }
     return -1;
 }
 
-int write_to_rom(FILE *out, MD5_CTX *md5_ctx, uint8_t *data, size_t data_length, t_part *part) {
-    static size_t global_offset = 0;
-    int i;
-
+int write_to_rom(t_plan *plan, uint8_t *data, size_t data_length, int source, t_part *part) {
     if (data) {
-        if (part->is_group) {
-            int n_writes = part->g.repeat ? part->g.repeat : 1;
-            for (i = 0; i < n_writes; i++) {
-                fwrite(data, 1, data_length, out);
-                MD5_Update(md5_ctx, data, data_length);
-                if (verbose) {
-                    printf("writing %lu bytes @ %08lX\n", data_length, global_offset);
-                }
-                global_offset += data_length;
-            }
+        if (part->p.offset >= data_length) {
+            printf("warning: offset set past the part size. Skipping part.\n");
+            return 0;
         } else {
-            if (part->p.offset >= data_length) {
-                printf("warning: offset set past the part size. Skipping part.\n");
-                return 0;
-            } else {
-                int n_writes = part->p.repeat ? part->p.repeat : 1;
-                size_t length = (part->p.length && (part->p.length < (data_length - part->p.offset))) ? part->p.length : (data_length - part->p.offset);
-                if (verbose) {
-                    printf("writing %lu bytes @ %08lX\n", length * n_writes, global_offset);
-                }
-                for (i = 0; i < n_writes; i++) {
-                    fwrite(data + part->p.offset, 1, length, out);
-                    MD5_Update(md5_ctx, data + part->p.offset, length);
-                    global_offset += length;
-                }
-            }
+            size_t n_writes = part->p.repeat ? part->p.repeat : 1;
+            size_t length = (part->p.length && (part->p.length < (data_length - part->p.offset))) ? part->p.length : (data_length - part->p.offset);
+            plan_copy(plan, data, data + part->p.offset, source, length, n_writes);
         }
     }
 
     return 0;
 }
 
-int get_data(t_part *part, uint8_t **data, size_t *size) {
+// Look for the zip entry of a part: first by crc, then by name. Returns -1 if not found.
+static int find_file(t_part *part) {
+    int n = -1;
+
+    if (part->p.crc32) {
+        n = get_file_by_crc(part->p.crc32);
+    }
+    if (n == -1 && part->p.name) {
+        n = get_file_by_name(part->p.name);
+    }
+    return n;
+}
+
+// Count the parts referencing each zip entry, so that only those entries get uncompressed, and how
+// much of the entry they read: parts with a length only need the entry up to offset + length.
+static void use_files(t_part *parts, int n_parts) {
+    int i, n;
+    size_t needed;
+
+    for (i = 0; i < n_parts; i++) {
+        if (parts[i].is_group) {
+            use_files(parts[i].g.parts, parts[i].g.n_parts);
+        } else if (!parts[i].p.zip) {
+            n = find_file(parts + i);
+            if (n < 0) continue;
+            files[n].used++;
+            needed = files[n].size;
+            // offset + length saturates at the size of the entry instead of wrapping around
+            if (parts[i].p.length && parts[i].p.offset < needed && parts[i].p.length < needed - parts[i].p.offset) {
+                needed = parts[i].p.offset + parts[i].p.length;
+            }
+            if (needed > files[n].needed) files[n].needed = needed;
+        }
+    }
+}
+
+// *source is set to the index of the zip entry data comes from, PLAN_NO_SOURCE for data of the MRA file
+int get_data(t_part *part, uint8_t **data, size_t *size, int *source) {
     int n;
 
     if (part->p.zip) {
@@ -88,23 +156,12 @@ int get_data(t_part *part, uint8_t **data, size_t *size) {
         return -1;
     }
 
-    n = -1;
-    if (part->p.name || part->p.crc32) {
-        if (part->p.crc32) {  // First, try to identify file by crc
-            n = get_file_by_crc(files, n_files, part->p.crc32);
-            if (n >= 0) {
-                if (verbose) {
-                    printf("part selected by CRC (%08X)\n", part->p.crc32);
-                }
-            }
-        }
-        if (n == -1 && part->p.name) {  // then by name
-            n = get_file_by_name(files, n_files, part->p.name);
-            if (n >= 0) {
-                if (verbose) {
-                    printf("part selected by name (%s)\n", part->p.name);
-                }
-            }
+    n = find_file(part);
+    if (n >= 0 && verbose) {
+        if (part->p.crc32 && files[n].crc32 == part->p.crc32) {
+            printf("part selected by CRC (%08X)\n", part->p.crc32);
+        } else {
+            printf("part selected by name (%s)\n", part->p.name);
         }
     }
     if (n == -1 && !part->p.data) {  // no file, no data => part not found
@@ -114,31 +171,38 @@ int get_data(t_part *part, uint8_t **data, size_t *size) {
     if (n != -1 && trace > 0) {
         printf("file:\n");
         printf("  name: %s\n", files[n].name);
-        printf("  size: %d\n", files[n].size);
+        printf("  size: %lu\n", files[n].size);
+    }
+    if (n != -1 && !files[n].data) {
+        printf("part could not be uncompressed: %s (%08x)\n", files[n].name, files[n].crc32);
+        return -1;
     }
 
     if (n != -1) {
         *data = files[n].data;
-        *size = files[n].size;
+        *size = files[n].source == FILE_DATA_PREFIX ? files[n].needed : files[n].size;  // only the prefix is there
+        *source = n;
     } else {
         *data = part->p.data;
         *size = part->p.data_length;
+        *source = PLAN_NO_SOURCE;
     }
 
     return 0;
 }
 
-int write_part(FILE *out, MD5_CTX *md5_ctx, t_part *part) {
+int write_part(t_plan *plan, t_part *part) {
     int res;
     uint8_t *data;
     size_t size;
+    int source;
 
-    res = get_data(part, &data, &size);
+    res = get_data(part, &data, &size, &source);
     if (res) {
         return res;
     }
 
-    if (write_to_rom(out, md5_ctx, data, size, part)) {
+    if (write_to_rom(plan, data, size, source, part)) {
         return -1;
     }
     return 0;
@@ -193,7 +257,7 @@ int parse_pattern(char *pattern, int **byte_offsets, int *n_src_bytes) {
     return 0;
 }
 
-static int do_write_group(FILE *out, MD5_CTX *md5_ctx, t_part *part, int **byte_offsets, int *n_src_bytes, uint8_t **data, size_t *size) {
+static int do_write_group(t_plan *plan, t_part *part, int **byte_offsets, int *n_src_bytes, uint8_t **data, size_t *size, int *sources) {
     int i;
 
     int n_dest_bytes = part->g.width >> 3;  // number of bytes per value defined by width attribute
@@ -202,7 +266,7 @@ static int do_write_group(FILE *out, MD5_CTX *md5_ctx, t_part *part, int **byte_
         int res;
         t_part *p_part = part->g.parts + i; 
 
-        res = get_data(p_part, data + i, size + i);
+        res = get_data(p_part, data + i, size + i, sources + i);
         // apply offset and length attribute
         if (p_part->p.offset + p_part->p.length > size[i]) {
             printf("%s:%d: error: part offset and length exceeds data size\n", __FILE__, __LINE__);
@@ -240,31 +304,12 @@ static int do_write_group(FILE *out, MD5_CTX *md5_ctx, t_part *part, int **byte_
         return -1;
     }
 
-    // Allocate final interleaved buffer
-    size_t total_bytes = n_values * n_bytes_value;
-    uint8_t *buffer = (uint8_t *)malloc(sizeof(uint8_t) * total_bytes);
-
-    uint8_t *dest = buffer;
-    for (i = 0; i < n_values; i++) {                    // iterate over values
-        for (int j = 0; j < part->g.n_parts; j++) {     // for each value, iterate over parts
-            for (int k = 0; k < n_src_bytes[j]; k++) {  // for each part, iterate over the pattern
-                size_t byte_offset = i * n_src_bytes[j] + byte_offsets[j][k];
-                if (trace > 1) printf("i, j, k, offset: %d , %d, %d, %lu\n", i, j, k, byte_offset);
-                *dest++ = data[j][byte_offset];
-            }
-        }
-    }
-
-    int res = write_to_rom(out, md5_ctx, buffer, total_bytes, part);
-    free(buffer);
-    if (res) {
-        return -1;
-    }
+    plan_gather(plan, part->g.n_parts, data, sources, byte_offsets, n_src_bytes, n_values, part->g.repeat ? part->g.repeat : 1);
 
     return 0;
 }
 
-int write_group(FILE *out, MD5_CTX *md5_ctx, t_part *part) {
+int write_group(t_plan *plan, t_part *part) {
     if (!part->g.is_interleaved) {
         printf("%s:%d: error: non interleaved groups are not implemented\n", __FILE__, __LINE__);
         return -1;
@@ -279,9 +324,10 @@ int write_group(FILE *out, MD5_CTX *md5_ctx, t_part *part) {
     int *n_src_bytes = (int *)calloc(part->g.n_parts, sizeof(int));
     uint8_t **data = (uint8_t **)calloc(part->g.n_parts, sizeof(uint8_t *));
     size_t *size = (size_t *)calloc(part->g.n_parts, sizeof(size_t));
+    int *sources = (int *)calloc(part->g.n_parts, sizeof(int));
     memset(byte_offsets, 0, part->g.n_parts * sizeof(int *));
 
-    int res = do_write_group(out, md5_ctx, part, byte_offsets, n_src_bytes, data, size);
+    int res = do_write_group(plan, part, byte_offsets, n_src_bytes, data, size, sources);
 
     for (int i = 0; i < part->g.n_parts; i++)
         if (byte_offsets[i]) free(byte_offsets[i]);
@@ -290,15 +336,27 @@ int write_group(FILE *out, MD5_CTX *md5_ctx, t_part *part) {
     free(n_src_bytes);
     free(data);
     free(size);
+    free(sources);
     return res;
 
 }
 
-static char *get_zip_filename(char *filename, t_string_list *dirs) {
+// When a directory has an index listing the zip file, *indexed is set to its entry, so that its central
+// directory need not be read. Zip files added after the index was built are still looked up on disk.
+static char *get_zip_filename(char *filename, t_string_list *dirs, t_zipindex **index, const t_zipindex_zip **indexed) {
     int i;
 
+    *index = NULL;
+    *indexed = NULL;
     for (i = 0; i < dirs->n_elements; i++) {
         char *result;
+
+        if ((*index = zipindex_get(dirs->elements[i]))) {
+            if ((*indexed = zipindex_find(*index, filename))) {
+                return get_filename(dirs->elements[i], filename, NULL);
+            }
+            *index = NULL;
+        }
         int length = strnlen(dirs->elements[i], 1024) + strnlen(filename, 1024);
         result = (char *)malloc(sizeof(char) * (length + 2));
         snprintf(result, 2050, "%s/%s", dirs->elements[i], filename);
@@ -309,6 +367,7 @@ static char *get_zip_filename(char *filename, t_string_list *dirs) {
         free(result);
     }
 
+    *index = NULL;
     if (file_exists(filename)) {
         return strndup(filename, 1024);
     }
@@ -316,100 +375,301 @@ static char *get_zip_filename(char *filename, t_string_list *dirs) {
     return NULL;
 }
 
+// Hand the data of an entry over to the cache, or give it back to where it comes from
+static void free_file_data(t_file *file) {
+    if (!file->data) return;
+    switch (file->source) {
+        case FILE_DATA_MALLOC:
+            if (file->loaded > 0) {
+                cache_put(file->crc32, file->size, file->data, file->arena);
+            } else {
+                unzip_free_data(file);  // never read by the plan
+            }
+            break;
+        case FILE_DATA_PREFIX:
+            unzip_free_data(file);
+            break;
+        case FILE_DATA_CACHE:
+            cache_release(file->crc32, file->size);
+            break;
+        case FILE_DATA_DISK:
+            diskcache_release(file->data, file->size);
+            break;
+    }
+    file->data = NULL;
+    if (file->loaded > 0) file->loaded = 0;
+}
+
+// plan_run() is about to read an entry: uncompress it, unless it comes from a cache
+static int load_file(void *ctx, int n) {
+    (void)ctx;
+    if (!files[n].loaded && unzip_load_file(zips, files + n)) {
+        printf("warning: failed to unzip file: %s (%s)\n", zips[files[n].zip].filename, files[n].name);
+    }
+    return files[n].loaded < 0 ? -1 : 0;
+}
+
+static size_t file_size(void *ctx, int n) {
+    (void)ctx;
+    return files[n].source == FILE_DATA_PREFIX ? files[n].needed : files[n].size;
+}
+
+// plan_run() is done with an entry: it goes before the ROM is complete. Together with load_file(),
+// peak memory use follows the entries being written instead of all the entries of the ROM.
+static void release_file(void *ctx, int n) {
+    (void)ctx;
+    free_file_data(files + n);
+}
+
 static void free_files() {
     int i;
 
-    if (!files) return;
     for (i = 0; i < n_files; i++) {
         if (files[i].name) free(files[i].name);
-        if (files[i].data) free(files[i].data);
-        files[i].name = files[i].data = 0;
+        free_file_data(files + i);
+        files[i].name = 0;
     }
     free(files);
     files = 0;
     n_files = 0;
+    free(crc_index);
+    free(name_index);
+    crc_index = name_index = 0;
+
+    // Mapped entries point into the zip files: close them last
+    for (i = 0; i < n_zips; i++) {
+        unzip_close(zips + i);
+    }
+    free(zips);
+    zips = 0;
+    n_zips = 0;
+}
+
+/*
+    In batch runs, the md5 of ROMs is computed up to MD5_BATCH_SIZE ROMs at a time with md5_batch(),
+    instead of one ROM after the other. ROMs are hashed from the mapping or buffer they were built in,
+    kept by plan_run() until the batch is done: the ROM files are not read back. ROMs with an md5 to
+    check are batched too, a mismatch is reported with the name of its ROM when the batch is flushed.
+    Runs asking for other digests (-H) hash each ROM as it is written instead.
+*/
+#define MD5_BATCH_SIZE 8
+
+typedef struct s_md5_check {
+    char *rom_filename;
+    char *md5;  // expected md5, NULL if none
+    t_plan_output output;
+} t_md5_check;
+
+static int md5_batch_enabled = 0;
+static t_md5_check md5_checks[MD5_BATCH_SIZE];
+static int n_md5_checks = 0;
+
+static void check_md5(char *rom_filename, char *expected, unsigned char md5[16]) {
+    char md5_string[33];
+
+    sprintf_md5(md5_string, md5);
+    if (verbose) {
+        printf("%s\t%s\n", md5_string, rom_filename);
+    }
+    if (expected) {
+        if (strcasecmp(expected, "none") != 0) {
+            if (strncmp(expected, md5_string, 33)) {
+                printf("warning: md5 mismatch for %s! (found: %s, expected: %s)\n", rom_filename, md5_string, expected);
+            } else if (verbose) {
+                printf("MD5s match! (%s)\n", expected);
+            }
+        }
+    }
+}
+
+void flush_md5_batch() {
+    const unsigned char *data[MD5_BATCH_SIZE];
+    size_t length[MD5_BATCH_SIZE];
+    unsigned char md5[MD5_BATCH_SIZE][16];
+    int i;
+
+    for (i = 0; i < n_md5_checks; i++) {
+        data[i] = md5_checks[i].output.data ? md5_checks[i].output.data : (const unsigned char *)"";
+        length[i] = md5_checks[i].output.size;
+    }
+
+    md5_batch(n_md5_checks, data, length, md5);
+
+    for (i = 0; i < n_md5_checks; i++) {
+        check_md5(md5_checks[i].rom_filename, md5_checks[i].md5, md5[i]);
+        plan_output_free(&md5_checks[i].output);
+        free(md5_checks[i].rom_filename);
+        free(md5_checks[i].md5);
+    }
+    n_md5_checks = 0;
+}
+
+// Batch md5 checks are done when the batch is full, when flush_md5_batch() is called and on exit
+void set_md5_batch() {
+    md5_batch_enabled = 1;
+    atexit(flush_md5_batch);
+}
+
+// Entries are taken from the caches when they are there, the others get a buffer to be uncompressed to
+static void prepare_files() {
+    int i;
+
+    for (i = 0; i < n_files; i++) {
+        int mapped;
+
+        if (!files[i].used || files[i].data || files[i].loaded) continue;
+        if ((files[i].data = cache_get(files[i].crc32, files[i].size))) {
+            files[i].source = FILE_DATA_CACHE;
+            files[i].loaded = 1;
+        } else if (cache_dir && (files[i].data = diskcache_get(files[i].crc32, files[i].size, &mapped))) {
+            files[i].source = mapped ? FILE_DATA_DISK : FILE_DATA_MALLOC;
+            files[i].loaded = 1;
+        }
+    }
+    unzip_prepare(zips, files, n_files);
+}
+
+static int count_failed_files() {
+    int i, n = 0;
+
+    for (i = 0; i < n_files; i++) {
+        if (files[i].loaded < 0) n++;
+    }
+    return n;
+}
+
+// Compile the ROM to a plan, then run it. Entries are uncompressed as the plan reaches them. Returns 1
+// if some of them could not be, the parts reading them are skipped when the ROM is built again.
+static int build_rom(t_rom *rom, char *rom_filename, int batch, t_digest *digest) {
+    FILE *out;
+    t_plan plan = {0};
+    int i, res, n_failed;
+
+    prepare_files();
+    n_failed = count_failed_files();
+
+    plan.load = load_file;
+    plan.source_size = file_size;
+    plan.release = release_file;
+    if (batch) plan.output = &md5_checks[n_md5_checks].output;
+
+    out = fopen(rom_filename, "w+b");  // read access as well, to map it
+
+    if (out == NULL) {
+        fprintf(stderr, "Couldn't open %s for writing!\n", rom_filename);
+        return -1;
+    }
+
+    for (i = 0; i < rom->n_parts; i++) {
+        t_part *part = rom->parts + i;
+
+        if (part->is_group) {
+            write_group(&plan, part);
+        } else {
+            write_part(&plan, part);
+        }
+    }
+    for (i = 0; i < rom->n_patches; i++) {
+        plan_patch(&plan, rom->patches[i].offset, rom->patches[i].data, rom->patches[i].data_length);
+    }
+    plan_optimize(&plan);
+
+    digest_init(digest, DIGEST_MD5 | digests);
+    res = plan_run(&plan, out, batch ? NULL : digest);
+    res = fclose(out) || res;
+    plan_free(&plan);
+
+    // Entries the plan did not read, if parts were skipped
+    for (i = 0; i < n_files; i++) {
+        free_file_data(files + i);
+    }
+    if (count_failed_files() > n_failed) return 1;
+    if (res) {
+        fprintf(stderr, "Couldn't write %s!\n", rom_filename);
+        return -1;
+    }
+    return 0;
 }
 
 int write_rom(t_rom *rom, t_string_list *dirs, char *rom_filename) {
-    char *zip_filename;
     int i, res;
 
-    // Load all zip files
+    // Read the central directory of all zip files
     for (i = 0; i < rom->zip.n_elements; i++) {
+        t_zipindex *index;
+        const t_zipindex_zip *indexed;
         char *zip_filename;
 
         // Look for zip file (first in user defined dir, then in current dir)
-        zip_filename = get_zip_filename(rom->zip.elements[i], dirs);
+        zip_filename = get_zip_filename(rom->zip.elements[i], dirs, &index, &indexed);
         if (!zip_filename) {
             printf("warning: zip file not found: %s\n", rom->zip.elements[i]);
             continue;
         }
-        if (verbose) {
-            printf("Uncompressing zip file: %s\n", zip_filename);
+        zips = (t_zip *)realloc(zips, sizeof(t_zip) * (n_zips + 1));
+        res = unzip_open(zips + n_zips, zip_filename);
+        if (res == 0) {
+            if (indexed && (indexed->size != zips[n_zips].size || indexed->mtime != zips[n_zips].mtime)) {
+                printf("warning: zip file changed since it was indexed: %s\n", zip_filename);
+                indexed = NULL;
+            }
+            if (indexed && zipindex_files(index, indexed, n_zips, &files, &n_files) == 0) {
+                if (verbose) {
+                    printf("Reading zip file from index: %s\n", zip_filename);
+                }
+            } else {
+                if (verbose) {
+                    printf("Reading zip file: %s\n", zip_filename);
+                }
+                res = unzip_file(zips + n_zips, n_zips, &files, &n_files);
+            }
+            n_zips++;
         }
-        res = unzip_file(zip_filename, &files, &n_files);
         if (res != 0) {
             printf("warning: failed to unzip file: %s\n", zip_filename);
         }
         free(zip_filename);
     }
 
+    index_files();
+
+    // Only uncompress the entries actually referenced by the parts of the ROM
+    use_files(rom->parts, rom->n_parts);
     if (verbose) {
+        for (i = 0; i < n_zips; i++) {
+            printf("Uncompressing zip file: %s\n", zips[i].filename);
+        }
         printf("FILE\t\tSIZE\tCRC\n");
         printf("----\t\t----\t---\n");
         for (i = 0; i < n_files; i++) {
-            printf("%s\t\t%d\t%X\n", files[i].name, files[i].size, files[i].crc32);
+            printf("%s\t\t%lu\t%X\n", files[i].name, files[i].size, files[i].crc32);
         }
     }
 
-    FILE *out;
-    MD5_CTX md5_ctx;
-    unsigned char md5[16];
-    char md5_string[33];
-
-    out = fopen(rom_filename, "wb");
-    MD5_Init(&md5_ctx);
-
-    if (out == NULL) {
-        fprintf(stderr, "Couldn't open %s for writing!\n", rom_filename);
-        free_files();
-        return -1;
-    }
-
-    for (i = 0; i < rom->n_parts; i++) {
-        int j, n;
-        t_part *part = rom->parts + i;
+    t_digest digest;
+    int batch = md5_batch_enabled && !low_memory && !digests;  // digests are computed as the ROM is written
 
-        if (part->is_group) {
-            write_group(out, &md5_ctx, part);
-        } else {
-            write_part(out, &md5_ctx, part);
-        }
+    // Entries that fail to uncompress are only found out once the plan runs: the ROM is then built
+    // again, without the parts reading them
+    while ((res = build_rom(rom, rom_filename, batch, &digest)) > 0) {
+        if (batch) plan_output_free(&md5_checks[n_md5_checks].output);
     }
-
     free_files();
-
-    // Apply patches before we close the file
-    for(i = 0; i < rom->n_patches; i++) {
-        fseek(out, rom->patches[i].offset, SEEK_SET);
-        fwrite(rom->patches[i].data, 1, rom->patches[i].data_length, out);
+    if (res) {
+        if (batch) plan_output_free(&md5_checks[n_md5_checks].output);
+        return -1;
     }
 
     // Done
-    fclose(out);
-    MD5_Final(md5, &md5_ctx);
-    sprintf_md5(md5_string, md5);
-    if (verbose) {
-        printf("%s\t%s\n", md5_string, rom_filename);
-    }
-    if (rom->md5) {
-        if( strncmp(rom->md5,"None",5)!=0 ) {
-            if (strncmp(rom->md5, md5_string, 33)) {
-                printf("warning: md5 mismatch! (found: %s, expected: %s)\n", md5_string, rom->md5);
-            } else if (verbose) {
-                printf("MD5s match! (%s)\n", rom->md5);
-            }
+    if (batch) {
+        md5_checks[n_md5_checks].rom_filename = strdup(rom_filename);
+        md5_checks[n_md5_checks].md5 = rom->md5 ? strdup(rom->md5) : NULL;
+        if (++n_md5_checks == MD5_BATCH_SIZE) {
+            flush_md5_batch();
         }
+    } else {
+        check_md5(rom_filename, rom->md5, digest.md5);
+        if (digests) digest_print(&digest, digests, rom_filename);
     }
     return 0;
 
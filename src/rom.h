@@ -6,5 +6,7 @@
 
 int write_rom0(t_mra *mra, t_string_list *dirs, char *rom_filename);
 int write_nvram(t_mra *mra, t_string_list *dirs, char *ram_filename);
+void set_md5_batch();
+void flush_md5_batch();
 
 #endif
\ No newline at end of file
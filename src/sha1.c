@@ -0,0 +1 @@
+char *sha1 = "faee250a15e4f7ee40e81c7fc1cfd24088e62aef";
@@ -1,7 +1,11 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
+#include "crc32.h"
+#include "diskcache.h"
 #include "utils.h"
 #include "junzip.h"
 #include "unzip.h"
@@ -9,88 +13,303 @@
 struct s_callback_data {
     t_file **files;
     int *n_files;
+    int zip;
 };
 
+// A buffer for the uncompressed data of file: a slice of the arena of its zip file if there is room left
+static unsigned char *alloc_data(t_file *file, t_arena *arena, size_t size) {
+    file->arena = NULL;
+    if (arena && (file->data = arena_alloc(arena, size))) {
+        file->arena = arena;
+        return file->data;
+    }
+    return file->data = (unsigned char *)malloc(size ? size : 1);
+}
+
+// Free the data of a FILE_DATA_MALLOC or FILE_DATA_PREFIX entry
+void unzip_free_data(t_file *file) {
+    if (file->arena) arena_free(file->arena, file->data, file->needed);
+    else free(file->data);
+    file->data = NULL;
+    file->arena = NULL;
+}
+
+static void crc_error(const char *filename, t_file *file) {
+    printf("error: crc mismatch for %s at offset %08llX (expected: %08X), the zip file is corrupt\n", filename,
+           (unsigned long long)file->offset, file->crc32);
+}
+
+// Read the local header of an entry. Sizes and crc are those of the central directory: when general
+// purpose bit 3 is set, the local header leaves them to a data descriptor following the data
+static int read_header(JZFile *zip, t_file *file, JZFileHeader *header, char *filename, int length) {
+    if (zip->seek(zip, file->offset, SEEK_SET)) {
+        printf("Cannot seek in zip file!");
+        return -1;
+    }
+
+    if (jzReadLocalFileHeader(zip, header, filename, length)) {
+        return -1;
+    }
+
+    header->crc32 = file->crc32;
+    header->compressedSize = file->compressed_size;
+    header->uncompressedSize = file->size;
+    return 0;
+}
+
+// Uncompress an entry to the buffer unzip_prepare() gave it, or check the crc of a stored entry used in place
 int processFile(JZFile *zip, t_file *file) {
     JZFileHeader header;
     char filename[1024];
+    int res;
 
-    if (jzReadLocalFileHeader(zip, &header, filename, sizeof(filename))) {
+    if (read_header(zip, file, &header, filename, sizeof(filename))) {
         return -1;
     }
 
-    file->name = strndup(filename, 1024);
-    file->crc32 = header.crc32;
-    file->size = header.uncompressedSize;
-    if ((file->data = (unsigned char *)malloc(header.uncompressedSize)) == NULL) {
-        printf("Couldn't allocate memory!");
-        return -1;
+    if (file->source == FILE_DATA_ZIP) {
+        if (crc32_update(0, file->data, file->size) != file->crc32) {
+            crc_error(filename, file);
+            return -1;
+        }
+        if (trace > 0) {
+            printf("%s, %llu bytes mapped at offset %08llX\n", filename,
+                   (unsigned long long)header.uncompressedSize, (unsigned long long)file->offset);
+        }
+        return 0;
+    }
+
+    // Parts only reading the start of the entry: inflate stops there
+    if (file->source == FILE_DATA_PREFIX) {
+        if (trace > 0) {
+            printf("%s, %lu / %llu bytes at offset %08llX\n", filename, (unsigned long)file->needed,
+                   (unsigned long long)header.uncompressedSize, (unsigned long long)file->offset);
+        }
+        if (jzReadDataPrefix(zip, &header, file->data, file->needed) != Z_OK) {
+            printf("Couldn't read file data!");
+            return -1;
+        }
+        if (verbose) {
+            printf("note: only %lu of %llu bytes of %s are uncompressed, its crc is not checked\n",
+                   (unsigned long)file->needed, (unsigned long long)header.uncompressedSize, filename);
+        }
+        return 0;
     }
 
     if (trace > 0) {
-        printf("%s, %d / %d bytes at offset %08X\n", filename,
-               header.compressedSize, header.uncompressedSize, header.offset);
+        printf("%s, %llu / %llu bytes at offset %08llX\n", filename, (unsigned long long)header.compressedSize,
+               (unsigned long long)header.uncompressedSize, (unsigned long long)file->offset);
     }
 
-    if (jzReadData(zip, &header, file->data) != Z_OK) {
+    res = jzReadData(zip, &header, file->data);
+    if (res == JZ_CRC_ERROR) {
+        crc_error(filename, file);
+    } else if (res != Z_OK) {
         printf("Couldn't read file data!");
-        free(file->data);
-        file->data = NULL;
-        return -1;
     }
-
-    return 0;
+    return res == Z_OK ? 0 : -1;
 }
 
 int recordCallback(JZFile *zip, int idx, JZFileHeader *header, char *filename, void *user_data) {
-    long offset;
     t_file **files = ((struct s_callback_data *)user_data)->files;
     int *n_files = ((struct s_callback_data *)user_data)->n_files;
+    t_file *file;
 
-    offset = zip->tell(zip);  // store current position
-
-    if (zip->seek(zip, header->offset, SEEK_SET)) {
-        printf("Cannot seek in zip file!");
-        return 0;  // abort
-    }
-
+    // The array was sized for all the entries of the central directory by unzip_file()
     (*n_files)++;
-    *files = (t_file *)realloc(*files, sizeof(t_file) * (*n_files));
-
-    processFile(zip, (*files) + (*n_files) - 1);  // alters file offset
 
-    zip->seek(zip, offset, SEEK_SET);  // return to position
+    // Only record the entry. Data is uncompressed later by unzip_load_file(), if the entry is used.
+    file = (*files) + (*n_files) - 1;
+    memset(file, 0, sizeof(t_file));
+    file->name = strndup(filename, 1024);
+    file->crc32 = header->crc32;
+    file->size = header->uncompressedSize;
+    file->compressed_size = header->compressedSize;
+    file->zip = ((struct s_callback_data *)user_data)->zip;
+    file->offset = header->offset;
 
     return 1;  // continue
 }
 
-int unzip_file(char *file, t_file **files, int *n_files) {
+int unzip_open(t_zip *zip, char *filename) {
     FILE *fp;
-    int retval = -1;
-    JZEndRecord endRecord;
-    JZFile *zip;
-    struct s_callback_data user_data = {files, n_files};
+    struct stat st;
 
-    if (!(fp = fopen(file, "rb"))) {
-        printf("Couldn't open \"%s\"!", file);
+    memset(zip, 0, sizeof(t_zip));
+    if (!(fp = fopen(filename, "rb"))) {
+        printf("Couldn't open \"%s\"!", filename);
         return -1;
     }
-    zip = jzfile_from_stdio_file(fp);
+    if (fstat(fileno(fp), &st) == 0) {
+        zip->size = st.st_size;
+        zip->mtime = st.st_mtime;
+    }
+    // Prefer a memory mapping: no stdio buffering and no copy of stored entries
+    if (!(zip->handle = jzfile_from_mmap_file(fp))) {
+        zip->handle = jzfile_from_stdio_file(fp);
+    }
+    zip->filename = strndup(filename, 1024);
+    return 0;
+}
+
+void unzip_close(t_zip *zip) {
+    if (zip->handle) zip->handle->close(zip->handle);
+    if (zip->filename) free(zip->filename);
+    memset(zip, 0, sizeof(t_zip));
+}
+
+// Read the central directory of a zip file and append its entries to files. No data is uncompressed.
+int unzip_file(t_zip *zip, int zip_index, t_file **files, int *n_files) {
+    JZEndRecord endRecord;
+    struct s_callback_data user_data = {files, n_files, zip_index};
+    t_file *grown;
 
-    if (jzReadEndRecord(zip, &endRecord)) {
+    if (jzReadEndRecord(zip->handle, &endRecord)) {
         printf("Couldn't read ZIP file end record.");
-        goto endClose;
+        return -1;
     }
 
-    if (jzReadCentralDirectory(zip, &endRecord, recordCallback, &user_data)) {
+    // The entry count comes from the file: no more entries than headers fit in the central directory
+    if (endRecord.numEntries > endRecord.centralDirectorySize / sizeof(JZGlobalFileHeader)) {
+        endRecord.numEntries = endRecord.centralDirectorySize / sizeof(JZGlobalFileHeader);
+    }
+    if (endRecord.numEntries > (uint64_t)(INT_MAX - *n_files)) {
+        printf("Too many entries in ZIP file.");
+        return -1;
+    }
+
+    if (!(grown = (t_file *)realloc(*files, sizeof(t_file) * (*n_files + endRecord.numEntries)))) {
+        printf("Couldn't allocate ZIP file entries.");
+        return -1;
+    }
+    *files = grown;
+
+    if (jzReadCentralDirectory(zip->handle, &endRecord, recordCallback, &user_data)) {
         printf("Couldn't read ZIP file central record.");
-        goto endClose;
+        return -1;
     }
 
-    retval = 0;
+    return 0;
+}
 
-endClose:
-    zip->close(zip);
+// Uncompress an entry prepared by unzip_prepare(). Can run on several threads at a time, for different entries.
+int unzip_load_file(t_zip *zips, t_file *file) {
+    t_zip *zip = zips + file->zip;
+    JZFile *handle = zip->handle;
+    FILE *fp;
+    int res;
 
-    return retval;
+    // JZFile handles have a position: each load needs its own when running in parallel
+    if (zip->handle->dup) {
+        handle = zip->handle->dup(zip->handle);
+    } else if (threads > 1) {
+        if (!(fp = fopen(zip->filename, "rb"))) {
+            printf("Couldn't open \"%s\"!", zip->filename);
+            file->loaded = -1;
+            return -1;
+        }
+        handle = jzfile_from_stdio_file(fp);
+    }
+
+    res = processFile(handle, file);
+    if (res == 0 && cache_dir && file->source == FILE_DATA_MALLOC) {
+        diskcache_put(file->crc32, file->size, file->data);
+    }
+
+    if (handle != zip->handle) {
+        handle->close(handle);
+    }
+
+    if (res != 0) {
+        if (file->source == FILE_DATA_ZIP) file->data = NULL;
+        else unzip_free_data(file);
+    }
+    file->loaded = res ? -1 : 1;
+    return res;
+}
+
+static int cmp_file_offset(const void *p1, const void *p2) {
+    const t_file *f1 = *(t_file **)p1, *f2 = *(t_file **)p2;
+
+    if (f1->zip != f2->zip) return f1->zip - f2->zip;
+    return f1->offset < f2->offset ? -1 : f1->offset > f2->offset;
+}
+
+// Stored entries of memory mapped zip files are used in place, the others get a buffer for the needed
+// bytes: a slice of the arena of their zip file, that only takes memory once the entry is uncompressed
+static int prepare_file(t_zip *zip, t_file *file) {
+    JZFileHeader header;
+    char filename[1024];
+    const void *data;
+
+    if (zip->handle->map) {
+        if (read_header(zip->handle, file, &header, filename, sizeof(filename))) {
+            return -1;
+        }
+        if (jzMapData(zip->handle, &header, &data) == Z_OK) {
+            file->data = (unsigned char *)data;
+            file->source = FILE_DATA_ZIP;
+            return 0;
+        }
+    }
+    if (alloc_data(file, zip->arena, file->needed) == NULL) {
+        printf("Couldn't allocate memory!");
+        return -1;
+    }
+    file->source = file->needed < file->size ? FILE_DATA_PREFIX : FILE_DATA_MALLOC;
+    return 0;
+}
+
+// Give the entries referenced by at least one part, and not taken from a cache, a buffer for their data.
+// Nothing is uncompressed yet: unzip_load_file() does it once the entry is about to be read, so that
+// memory follows the entries being read instead of all the entries of the ROM. Returns -1 if an entry
+// could not be prepared, it is then marked as not loaded.
+int unzip_prepare(t_zip *zips, t_file *files, int n_files) {
+    t_file **jobs;
+    int i, n_jobs = 0, n_zips = 0, res = 0;
+    size_t *arena_sizes;
+
+    jobs = (t_file **)malloc(sizeof(t_file *) * (n_files + 1));
+    for (i = 0; i < n_files; i++) {
+        if (files[i].used && !files[i].data && !files[i].loaded) {
+            // The crc can only be checked on the whole entry: inflate all of it when most of it is needed anyway
+            if (files[i].needed >= files[i].size / 2) files[i].needed = files[i].size;
+            jobs[n_jobs++] = files + i;
+            if (files[i].zip >= n_zips) n_zips = files[i].zip + 1;
+        }
+    }
+
+    // One arena per zip file, sized for all the entries to uncompress from it. Entries are released one
+    // by one: an arena that cannot give their pages back would keep them all, they are malloc'd instead.
+    arena_sizes = (size_t *)calloc(n_zips + 1, sizeof(size_t));
+    for (i = 0; i < n_jobs; i++) {
+        arena_sizes[jobs[i]->zip] += ARENA_SLICE(jobs[i]->needed);
+    }
+    for (i = 0; i < n_zips; i++) {
+        if (arena_sizes[i]) zips[i].arena = arena_new(arena_sizes[i]);
+        if (zips[i].arena && !arena_frees_pages(zips[i].arena)) {
+            arena_release(zips[i].arena);
+            zips[i].arena = NULL;
+        }
+    }
+    // Local headers are read in the order they are stored in each zip file
+    qsort(jobs, n_jobs, sizeof(t_file *), cmp_file_offset);
+
+    for (i = 0; i < n_jobs; i++) {
+        if (prepare_file(zips + jobs[i]->zip, jobs[i])) {
+            printf("warning: failed to unzip file: %s (%s)\n", zips[jobs[i]->zip].filename, jobs[i]->name);
+            jobs[i]->data = NULL;
+            jobs[i]->loaded = -1;
+            res = -1;
+        }
+    }
+
+    // Slices hold their own reference: arenas go away with their last entry
+    for (i = 0; i < n_zips; i++) {
+        if (zips[i].arena) arena_release(zips[i].arena);
+        zips[i].arena = NULL;
+    }
+    free(arena_sizes);
+    free(jobs);
+    return res;
 }
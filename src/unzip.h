@@ -2,15 +2,44 @@
 #define _UNZIP_H_
 
 #include <stdint.h>
+#include "arena.h"
 #include "globals.h"
+#include "junzip.h"
+
+typedef struct s_zip {
+    char *filename;
+    JZFile *handle;   // stays open as long as mapped entries point into it
+    uint64_t size;
+    int64_t mtime;
+    t_arena *arena;   // entries get their slice there while unzip_prepare() runs
+} t_zip;
 
 typedef struct s_file {
     char *name;
     uint32_t crc32;
     unsigned char *data;
-    int size;
+    size_t size;
+    uint64_t compressed_size;  // sizes come from the central directory, local headers can leave them out
+    int zip;          // index of the zip file this entry comes from
+    uint64_t offset;  // offset of the local file header in the zip file, Zip64 archives go past 4 GB
+    int used;         // number of parts referencing this entry. Only used entries get uncompressed.
+    size_t needed;    // bytes the parts read from the start of the entry, size if they read it all
+    int source;       // where data comes from, one of FILE_DATA_*
+    t_arena *arena;   // arena data is a slice of, NULL if it was malloc'd
+    int loaded;       // 1 once data is filled in, -1 if the entry could not be uncompressed
 } t_file;
 
-int unzip_file(char *file, t_file **files, int *n_files);
+#define FILE_DATA_MALLOC 0  // uncompressed to a malloc'd buffer or an arena, handed over to the cache when done
+#define FILE_DATA_ZIP 1     // stored entry pointing into the memory mapped zip file
+#define FILE_DATA_CACHE 2   // belongs to the cache of uncompressed entries
+#define FILE_DATA_DISK 3    // memory mapped from the disk cache
+#define FILE_DATA_PREFIX 4  // first needed bytes only, uncompressed like FILE_DATA_MALLOC but never cached
+
+int unzip_open(t_zip *zip, char *filename);
+int unzip_file(t_zip *zip, int zip_index, t_file **files, int *n_files);
+int unzip_prepare(t_zip *zips, t_file *files, int n_files);
+int unzip_load_file(t_zip *zips, t_file *file);
+void unzip_close(t_zip *zip);
+void unzip_free_data(t_file *file);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,333 @@
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "globals.h"
+#include "junzip.h"
+#include "utils.h"
+#include "zipindex.h"
+
+#define ZIPINDEX_VERSION 3  // 2: 64 bit offsets and sizes, 3: entries in central directory order
+
+struct s_zipindex {
+    char *dir;
+    JZFile *handle;   // mapping of the index file
+    uint8_t *buffer;  // copy of the index file when it cannot be mapped
+    const t_zipindex_header *header;
+    const t_zipindex_zip *zips;
+    const t_zipindex_entry *entries;
+    const char *names;
+    uint64_t names_size;
+};
+
+// Indexes loaded so far, one per directory. A NULL index means the directory has none.
+static t_zipindex **indexes = NULL;
+static int n_indexes = 0;
+
+/*
+    Index creation
+*/
+
+typedef struct s_scan_entry {
+    t_zipindex_entry entry;
+    char *name;
+} t_scan_entry;
+
+typedef struct s_scan_zip {
+    char *name;
+    uint64_t size;
+    int64_t mtime;
+    t_scan_entry *entries;
+    int n_entries;
+} t_scan_zip;
+
+static int scan_callback(JZFile *zip, int idx, JZFileHeader *header, char *filename, void *user_data) {
+    t_scan_zip *scan = (t_scan_zip *)user_data;
+    t_scan_entry *entry;
+
+    scan->entries = (t_scan_entry *)realloc(scan->entries, sizeof(t_scan_entry) * (scan->n_entries + 1));
+    entry = scan->entries + scan->n_entries;
+    memset(entry, 0, sizeof(t_scan_entry));
+    entry->entry.crc32 = header->crc32;
+    entry->entry.offset = header->offset;
+    entry->entry.compressed_size = header->compressedSize;
+    entry->entry.uncompressed_size = header->uncompressedSize;
+    entry->entry.method = header->compressionMethod;
+    entry->name = strndup(filename, 1024);
+    scan->n_entries++;
+
+    return 1;  // continue
+}
+
+// Only the central directory is read, no data is uncompressed
+static int scan_zip(char *filename, t_scan_zip *scan) {
+    JZEndRecord endRecord;
+    JZFile *zip;
+    FILE *fp;
+    struct stat st;
+    int res = -1;
+
+    if (!(fp = fopen(filename, "rb"))) {
+        printf("Couldn't open \"%s\"!\n", filename);
+        return -1;
+    }
+    if (fstat(fileno(fp), &st)) {
+        fclose(fp);
+        return -1;
+    }
+    scan->size = st.st_size;
+    scan->mtime = st.st_mtime;
+    zip = jzfile_from_stdio_file(fp);
+    if (jzReadEndRecord(zip, &endRecord) == Z_OK &&
+        jzReadCentralDirectory(zip, &endRecord, scan_callback, scan) == Z_OK) {
+        res = 0;
+    }
+    zip->close(zip);
+    return res;
+}
+
+static void free_scan(t_scan_zip *scan) {
+    for (int i = 0; i < scan->n_entries; i++) free(scan->entries[i].name);
+    free(scan->entries);
+    free(scan->name);
+}
+
+static int cmp_scan_zip(const void *p1, const void *p2) {
+    return strcmp(((t_scan_zip *)p1)->name, ((t_scan_zip *)p2)->name);
+}
+
+static int is_zip_filename(char *filename) {
+    size_t length = strlen(filename);
+    char *extension;
+    int res;
+
+    if (length < 4) return 0;
+    extension = str_tolower(filename + length - 4);
+    res = strcmp(extension, ".zip") == 0;
+    free(extension);
+    return res;
+}
+
+// Scan all zip files of a directory and write their entries to the index file of the directory
+int zipindex_write(char *dir) {
+    t_zipindex_header header = {{'M', 'R', 'A', 'I'}, ZIPINDEX_VERSION, 0, 0};
+    t_scan_zip *scans = NULL;
+    int n_scans = 0;
+    struct dirent *dirent;
+    uint32_t names_size = 0;
+    char *index_filename, *tmp_filename;
+    DIR *d;
+    FILE *out;
+    int i, j, res = 0;
+
+    if (!(d = opendir(dir))) {
+        printf("error: cannot open directory: %s\n", dir);
+        return -1;
+    }
+    while ((dirent = readdir(d))) {
+        char *zip_filename;
+
+        if (!is_zip_filename(dirent->d_name)) continue;
+        scans = (t_scan_zip *)realloc(scans, sizeof(t_scan_zip) * (n_scans + 1));
+        memset(scans + n_scans, 0, sizeof(t_scan_zip));
+        scans[n_scans].name = strdup(dirent->d_name);
+        zip_filename = get_filename(dir, dirent->d_name, NULL);
+        if (scan_zip(zip_filename, scans + n_scans)) {
+            printf("warning: failed to read zip file: %s. Not indexed.\n", zip_filename);
+            free_scan(scans + n_scans);
+        } else {
+            n_scans++;
+        }
+        free(zip_filename);
+    }
+    closedir(d);
+
+    qsort(scans, n_scans, sizeof(t_scan_zip), cmp_scan_zip);
+
+    index_filename = get_filename(dir, ZIPINDEX_FILENAME, NULL);
+    tmp_filename = get_filename(dir, ZIPINDEX_FILENAME, "tmp");
+    if (!(out = fopen(tmp_filename, "wb"))) {
+        printf("error: cannot create index file: %s\n", tmp_filename);
+        res = -1;
+        goto end;
+    }
+
+    // Header and zip files
+    header.n_zips = n_scans;
+    for (i = 0; i < n_scans; i++) header.n_entries += scans[i].n_entries;
+    fwrite(&header, sizeof(header), 1, out);
+    for (i = 0, j = 0; i < n_scans; i++) {
+        t_zipindex_zip zip = {names_size, j, scans[i].n_entries, 0, scans[i].size, scans[i].mtime};
+        fwrite(&zip, sizeof(zip), 1, out);
+        names_size += strlen(scans[i].name) + 1;
+        j += scans[i].n_entries;
+    }
+
+    // Entries
+    for (i = 0; i < n_scans; i++) {
+        for (j = 0; j < scans[i].n_entries; j++) {
+            scans[i].entries[j].entry.name = names_size;
+            names_size += strlen(scans[i].entries[j].name) + 1;
+            fwrite(&scans[i].entries[j].entry, sizeof(t_zipindex_entry), 1, out);
+        }
+    }
+
+    // Names, in the same order as the zip files and entries
+    for (i = 0; i < n_scans; i++) {
+        fwrite(scans[i].name, strlen(scans[i].name) + 1, 1, out);
+    }
+    for (i = 0; i < n_scans; i++) {
+        for (j = 0; j < scans[i].n_entries; j++) {
+            fwrite(scans[i].entries[j].name, strlen(scans[i].entries[j].name) + 1, 1, out);
+        }
+    }
+
+    if (ferror(out)) res = -1;
+    if (fclose(out)) res = -1;
+    if (res) {
+        printf("error: failed to write index file: %s\n", tmp_filename);
+        remove(tmp_filename);
+        goto end;
+    }
+#if defined(_WIN32) || defined(_WIN64)
+    remove(index_filename);  // rename() does not replace existing files on Windows
+#endif
+    if (rename(tmp_filename, index_filename)) {
+        printf("error: cannot create index file: %s\n", index_filename);
+        remove(tmp_filename);
+        res = -1;
+        goto end;
+    }
+    printf("%s: %d zip files, %d entries\n", index_filename, header.n_zips, header.n_entries);
+
+end:
+    for (i = 0; i < n_scans; i++) {
+        free_scan(scans + i);
+    }
+    free(scans);
+    free(index_filename);
+    free(tmp_filename);
+    return res;
+}
+
+/*
+    Index lookup
+*/
+
+static t_zipindex *load_index(char *dir) {
+    t_zipindex *index = (t_zipindex *)calloc(1, sizeof(t_zipindex));
+    const t_zipindex_header *header;
+    const uint8_t *data = NULL;
+    uint64_t size = 0, names_offset;
+    char *filename;
+    FILE *fp;
+
+    index->dir = strndup(dir, 1024);
+    filename = get_filename(dir, ZIPINDEX_FILENAME, NULL);
+    fp = fopen(filename, "rb");
+    if (!fp) {
+        free(filename);
+        return index;  // no index in this directory
+    }
+
+    if ((index->handle = jzfile_from_mmap_file(fp))) {
+        index->handle->seek(index->handle, 0, SEEK_END);
+        size = index->handle->tell(index->handle);
+        index->handle->seek(index->handle, 0, SEEK_SET);
+        data = index->handle->map(index->handle, size);
+    } else if (fseek(fp, 0, SEEK_END) == 0 && (long)(size = ftell(fp)) > 0 && fseek(fp, 0, SEEK_SET) == 0) {
+        index->buffer = (uint8_t *)malloc(size);
+        if (fread(index->buffer, 1, size, fp) == size) data = index->buffer;
+        fclose(fp);
+    } else {
+        fclose(fp);
+    }
+
+    // Sanity checks, so that lookups never read past the end of the index
+    header = (const t_zipindex_header *)data;
+    names_offset = header ? sizeof(t_zipindex_header) + (uint64_t)header->n_zips * sizeof(t_zipindex_zip) + (uint64_t)header->n_entries * sizeof(t_zipindex_entry) : 0;
+    if (!data || size < sizeof(t_zipindex_header) || memcmp(header->magic, "MRAI", 4) ||
+        header->version != ZIPINDEX_VERSION || names_offset > size || (names_offset < size && data[size - 1] != '\0')) {
+        printf("warning: invalid index file: %s. Ignored.\n", filename);
+        free(filename);
+        return index;
+    }
+    free(filename);
+
+    index->header = header;
+    index->zips = (const t_zipindex_zip *)(data + sizeof(t_zipindex_header));
+    index->entries = (const t_zipindex_entry *)(index->zips + header->n_zips);
+    index->names = (const char *)(data + names_offset);
+    index->names_size = size - names_offset;
+
+    return index;
+}
+
+// Index of a directory, read once per process. NULL if the directory has no valid index.
+t_zipindex *zipindex_get(char *dir) {
+    int i;
+
+    for (i = 0; i < n_indexes; i++) {
+        if (strncmp(indexes[i]->dir, dir, 1024) == 0) break;
+    }
+    if (i == n_indexes) {
+        indexes = (t_zipindex **)realloc(indexes, sizeof(t_zipindex *) * (n_indexes + 1));
+        indexes[n_indexes++] = load_index(dir);
+        if (verbose && indexes[i]->header) {
+            printf("using zip index: %s/%s\n", dir, ZIPINDEX_FILENAME);
+        }
+    }
+    return indexes[i]->header ? indexes[i] : NULL;
+}
+
+static const char *get_name(t_zipindex *index, uint32_t offset) {
+    return offset < index->names_size ? index->names + offset : "";
+}
+
+const t_zipindex_zip *zipindex_find(t_zipindex *index, char *zip_name) {
+    int lo = 0, hi = (int)index->header->n_zips - 1;
+
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        int res = strcmp(zip_name, get_name(index, index->zips[mid].name));
+
+        if (res == 0) return index->zips + mid;
+        if (res < 0) {
+            hi = mid - 1;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return NULL;
+}
+
+// Append the entries of an indexed zip file to files, as unzip_file() does from the central directory
+int zipindex_files(t_zipindex *index, const t_zipindex_zip *zip, int zip_index, t_file **files, int *n_files) {
+    t_file *grown;
+    uint32_t i;
+
+    if (zip->first_entry > index->header->n_entries || zip->n_entries > index->header->n_entries - zip->first_entry ||
+        zip->n_entries > (uint32_t)(INT_MAX - *n_files)) {
+        return -1;
+    }
+    if (!(grown = (t_file *)realloc(*files, sizeof(t_file) * (*n_files + zip->n_entries)))) {
+        return -1;
+    }
+    *files = grown;
+    for (i = 0; i < zip->n_entries; i++) {
+        const t_zipindex_entry *entry = index->entries + zip->first_entry + i;
+        t_file *file = (*files) + (*n_files)++;
+
+        memset(file, 0, sizeof(t_file));
+        file->name = strndup(get_name(index, entry->name), 1024);
+        file->crc32 = entry->crc32;
+        file->size = entry->uncompressed_size;
+        file->compressed_size = entry->compressed_size;
+        file->zip = zip_index;
+        file->offset = entry->offset;
+    }
+    return 0;
+}
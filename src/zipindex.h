@@ -0,0 +1,50 @@
+#ifndef _ZIPINDEX_H_
+#define _ZIPINDEX_H_
+
+#include <stdint.h>
+#include "unzip.h"
+
+#define ZIPINDEX_FILENAME "mra.idx"
+
+typedef struct s_zipindex t_zipindex;
+
+/*
+    On disk layout of the index file, all values in host byte order:
+        t_zipindex_header
+        t_zipindex_zip[n_zips]          sorted by zip file name
+        t_zipindex_entry[n_entries]     grouped by zip file, in central directory order within a zip file
+        names                           NUL terminated strings, referenced by offset from the start of the names
+*/
+typedef struct s_zipindex_header {
+    char magic[4];  // "MRAI"
+    uint32_t version;
+    uint32_t n_zips;
+    uint32_t n_entries;
+} t_zipindex_header;
+
+typedef struct s_zipindex_zip {
+    uint32_t name;
+    uint32_t first_entry;
+    uint32_t n_entries;
+    uint32_t reserved;
+    uint64_t size;   // size and modification time of the zip file when it was indexed
+    int64_t mtime;
+} t_zipindex_zip;
+
+typedef struct s_zipindex_entry {
+    uint32_t crc32;
+    uint32_t name;
+    uint64_t offset;  // offset of the local file header, 64 bits for Zip64 archives
+    uint64_t compressed_size;
+    uint64_t uncompressed_size;
+    uint16_t method;
+    uint16_t reserved;
+    uint32_t reserved2;
+} t_zipindex_entry;
+
+int zipindex_write(char *dir);
+t_zipindex *zipindex_get(char *dir);
+const t_zipindex_zip *zipindex_find(t_zipindex *index, char *zip_name);
+int zipindex_files(t_zipindex *index, const t_zipindex_zip *zip, int zip_index, t_file **files, int *n_files);
+
+#endif
@@ -22,6 +22,9 @@ echo
 echo "Test Mister interleaving...(expected: no warnings)"
 ./mra tests/test_mister_interleave.mra -O tests/results
 echo
+echo "Test interleave kernels...(expected: no warnings)"
+./mra tests/test_interleave_kernels.mra -O tests/results
+echo
 echo "Test endianess...(expected: no warnings)"
 ./mra tests/test_endianess.mra -O tests/results
 echo
@@ -46,9 +49,60 @@ echo
 echo "Test Multi zips source...(expected: 1 warning)"
 ./mra tests/test_multi_zips.mra -O tests/results
 echo
+echo "Test corrupt zip...(expected: 2 errors, 2 warnings)"
+./mra tests/test_corrupt_zip.mra -O tests/results
+echo
+echo "Test data descriptor...(expected: no warnings)"
+./mra tests/test_descriptor.mra -O tests/results
+echo
+echo "Test partial entry...(expected: no warnings)"
+./mra -v tests/test_partial_entry.mra -O tests/results > tests/logs/test_partial_entry.log
+grep '^note' tests/logs/test_partial_entry.log > tests/results/partial_entry_test
+echo
+echo "Test Zip64...(expected: no warnings)"
+./mra tests/test_zip64.mra -O tests/results
+echo
 echo "Test Patch...(expected: no warnings)"
 ./mra tests/test_patch.mra -O tests/results
 echo
+echo "Test low memory...(expected: no warnings)"
+./mra -L -j 4 tests/test_patch.mra -o test_low_memory.rom -O tests/results
+echo
+echo "Test zip index...(expected: no warnings)"
+mkdir -p tests/tmp/index
+cp tests/tests.zip tests/tmp/index
+./mra index tests/tmp/index > tests/logs/test_zip_index.log
+cp tests/tests2.zip tests/tmp/index
+./mra -v tests/test_multi_zips.mra -z tests/tmp/index -o test_zip_index.rom -O tests/results >> tests/logs/test_zip_index.log
+grep '^Reading zip file' tests/logs/test_zip_index.log > tests/results/zip_index_test
+echo
+echo "Test corrupt disk cache...(expected: 1 warning)"
+mkdir -p tests/tmp/cache
+./mra tests/test_repeat.mra -c tests/tmp/cache -O tests/tmp/cache > tests/logs/test_disk_cache.log
+printf 'X' | dd of=`ls tests/tmp/cache/*.bin | head -1` conv=notrunc status=none
+./mra tests/test_repeat.mra -c tests/tmp/cache -o test_disk_cache.rom -O tests/results
+echo
+echo "Test md5 batch...(expected: no warnings)"
+mkdir -p tests/tmp/batch
+./mra -v tests/test_embedded_data.mra tests/test_md5_mismatch.mra tests/test_offset_length.mra tests/test_repeat.mra tests/test_interleaved_part.mra \
+    tests/test_mister_interleave.mra tests/test_endianess.mra tests/test_interleave_kernels.mra tests/test_select_by_crc.mra tests/test_patch.mra \
+    -O tests/tmp/batch > tests/logs/test_md5_batch.log
+grep -E '^[0-9a-f]{32}' tests/logs/test_md5_batch.log | sed 's|tests/tmp/batch/||' > tests/results/md5_batch_test
+echo
+echo "Test digests...(expected: no warnings)"
+mkdir -p tests/tmp/digests
+./mra -H md5,crc32,sha1 tests/test_repeat.mra tests/test_interleave_kernels.mra tests/test_patch.mra -O tests/tmp/digests > tests/logs/test_digests.log
+./mra -L -H crc32,sha1 tests/test_patch.mra -o test_digests_low_memory.rom -O tests/tmp/digests >> tests/logs/test_digests.log
+grep -E '	(md5|crc32):' tests/logs/test_digests.log | sed 's|tests/tmp/digests/||' > tests/results/digests_test
+echo
+echo "Test md5 body...(expected: no mismatches)"
+gcc -O2 -Isrc/md5 tests/test_md5.c src/md5/md5.c -o tests/tmp/test_md5
+tests/tmp/test_md5 > tests/results/md5_body_test
+echo
+echo "Test crc32...(expected: no mismatches)"
+gcc -O2 -Isrc tests/test_crc32.c src/crc32.c -o tests/tmp/test_crc32 -lz -lpthread
+tests/tmp/test_crc32 > tests/results/crc32_test
+echo
 echo "Test file names...(expected: no warnings)"
 ./mra_dir.sh samples/Robotron -AO tests/tmp > tests/logs/test_file_names.log
 ls -1 tests/tmp | grep -E '\.rom|\.arc' | LC_ALL=C sort > tests/results/filenames_test
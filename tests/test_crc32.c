@@ -0,0 +1,42 @@
+// Checks crc32_update() and the portable slice-by-16 code against zlib: prints the crcs of zlib
+// and fails if any other implementation disagrees, for every length and alignment around the
+// 16 and 64 bytes blocks of the kernels.
+#include <stdio.h>
+#include <stdlib.h>
+#include <zlib.h>
+
+#include "crc32.h"
+
+#define MAX_LENGTH 4099
+
+int main() {
+    unsigned char *data = malloc(MAX_LENGTH + 16);
+    unsigned int seed = 0x87654321;
+    size_t i, length, offset;
+    uint32_t expected;
+    int res = 0;
+
+    for (i = 0; i < MAX_LENGTH + 16; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        data[i] = seed;
+    }
+    for (length = 0; length <= MAX_LENGTH; length += length < 300 ? 1 : 61) {
+        for (offset = 0; offset < 16; offset++) {
+            expected = crc32(length, data + offset, length);
+            if (crc32_update(length, data + offset, length) != expected) {
+                printf("length %lu offset %lu: crc32_update mismatch\n", (unsigned long)length, (unsigned long)offset);
+                res = -1;
+            }
+            if (crc32_portable(length, data + offset, length) != expected) {
+                printf("length %lu offset %lu: crc32_portable mismatch\n", (unsigned long)length, (unsigned long)offset);
+                res = -1;
+            }
+        }
+        printf("%08x length %lu\n", crc32(0, data, length), (unsigned long)length);
+    }
+
+    free(data);
+    return res ? 1 : 0;
+}
@@ -0,0 +1,80 @@
+// Checks the MD5 block functions against each other: prints the digests of the reference
+// implementation and fails if any other variant this CPU can run disagrees.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "md5.h"
+
+#define MAX_LENGTH 4099
+
+static const char *vectors[] = {
+    "",
+    "a",
+    "abc",
+    "message digest",
+    "abcdefghijklmnopqrstuvwxyz",
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789",
+    "12345678901234567890123456789012345678901234567890123456789012345678901234567890",
+};
+
+static void digest(int variant, const unsigned char *data, size_t length, size_t step, unsigned char md5[16]) {
+    MD5_CTX ctx;
+    size_t i;
+
+    MD5_Use_Body(variant);
+    MD5_Init(&ctx);
+    for (i = 0; i < length; i += step) {
+        MD5_Update(&ctx, data + i, length - i < step ? length - i : step);
+    }
+    MD5_Final(md5, &ctx);
+}
+
+static int check(const char *name, const unsigned char *data, size_t length, size_t step) {
+    unsigned char expected[16], md5[16];
+    int variant, i, res = 0;
+
+    digest(MD5_BODY_REFERENCE, data, length, length ? length : 1, expected);
+    for (variant = MD5_BODY_TUNED; variant <= MD5_BODY_BMI; variant++) {
+        if (MD5_Use_Body(variant))
+            continue;
+        digest(variant, data, length, step, md5);
+        if (memcmp(md5, expected, 16)) {
+            printf("%s: body %d mismatch\n", name, variant);
+            res = -1;
+        }
+    }
+    for (i = 0; i < 16; i++) {
+        printf("%02x", expected[i]);
+    }
+    printf(" %s\n", name);
+    return res;
+}
+
+int main() {
+    unsigned char *data = malloc(MAX_LENGTH);
+    unsigned int seed = 0x12345678;
+    size_t i, length;
+    char name[64];
+    int res = 0;
+
+    for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        sprintf(name, "\"%s\"", vectors[i]);
+        res |= check(name, (const unsigned char *)vectors[i], strlen(vectors[i]), 1);
+    }
+
+    // xorshift data, every length around the 64 byte blocks and the 56 byte padding limit
+    for (i = 0; i < MAX_LENGTH; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        data[i] = seed;
+    }
+    for (length = 0; length <= MAX_LENGTH; length += length < 200 ? 1 : 61) {
+        sprintf(name, "random %lu", (unsigned long)length);
+        res |= check(name, data, length, 1 + length % 67);
+    }
+
+    free(data);
+    return res ? 1 : 0;
+}